@@ -13,6 +13,23 @@
 #include "bzexp.hh"
 #include "bztrig.hh"
 #include "bzhyperbolic.hh"
+#include "bzstatic.hh"
+#include "bzshared.hh"
+#include "bzcontext.hh"
+#include "bzbind.hh"
+#include "bzbatch.hh"
+#include "bzleaves.hh"
+#include "bzdag.hh"
+#include "bzparse.hh"
+#include "bztape.hh"
+#include "bzerase.hh"
+#include "bzsimd.hh"
+#include "bzparallel.hh"
+#include "bztaylor.hh"
+#include "bzstencil.hh"
+#include "bzjacobian.hh"
+#include "bzcodegen.hh"
+#include "bzjit.hh"
 
 #endif      // _BENZAITEN_HH_
 
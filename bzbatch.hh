@@ -0,0 +1,122 @@
+#ifndef _BZBATCH_HH_
+#define _BZBATCH_HH_
+
+#include "bzexpression.hh"
+#include "bzbind.hh"
+
+#include <limits>
+
+namespace benzaiten
+{
+    /**
+     * Structure-of-arrays storage for evaluating an expression at many
+     * points: one array per variable and function derivative. Point `i`
+     * reads `data[i * stride]`, so a stride of zero broadcasts a single
+     * value, such as the current time, to every point.
+     */
+    struct FieldLayout
+    {
+        FieldLayout() { }
+
+        FieldLayout(const Schema &schema) : schema(schema),
+            fields(schema.size(), nullptr), strides(schema.size(), 0) { }
+
+        FieldLayout& set(const std::string &name,
+            const std::unordered_map<std::string, size_t> &d,
+            const double *data, size_t stride = 1)
+        {
+            return set(schema.add(name, d), data, stride);
+        }
+
+        FieldLayout& set(const std::string &name, const double *data, size_t stride = 1)
+        {
+            return set(schema.add(name), data, stride);
+        }
+
+        FieldLayout& set(const Variable &vbl, const double *data, size_t stride = 1)
+        {
+            return set(schema.add(vbl), data, stride);
+        }
+
+        FieldLayout& set(size_t slot, const double *data, size_t stride = 1)
+        {
+            if (slot >= fields.size())
+            {
+                fields.resize(slot + 1, nullptr);
+                strides.resize(slot + 1, 0);
+            }
+
+            fields[slot] = data;
+            strides[slot] = stride;
+            return *this;
+        }
+
+        const Schema& getSchema() const { return schema; }
+
+        const double* field(size_t slot) const { return fields[slot]; }
+
+        /// @return Number of slots that may have a field; every slot past them has none
+        size_t numFields() const { return fields.size(); }
+
+        size_t stride(size_t slot) const { return strides[slot]; }
+
+        private:
+            Schema schema;
+            std::vector<const double*> fields;
+            std::vector<size_t> strides;
+    };
+
+    /// Context replaying recorded slots against the fields at one point
+    struct FieldReader
+    {
+        FieldReader(const FieldLayout &layout, const size_t *slots, size_t index) :
+            layout(layout), cursor(slots), index(index) { }
+
+        double constant(double value) const { return value; }
+
+        template <typename L>
+        double lookup(const L &) const
+        {
+            size_t slot = *cursor++;
+
+            if ((slot == Schema::npos) || (layout.field(slot) == nullptr))
+            {
+                return std::numeric_limits<double>::quiet_NaN();
+            }
+
+            return layout.field(slot)[index * layout.stride(slot)];
+        }
+
+        const FieldLayout &layout;
+        mutable const size_t *cursor;
+        size_t index;
+    };
+
+    /**
+     * Evaluate a plan at `n` points, writing `out[i]` for each. The plan
+     * must have been bound to the schema of the layout.
+     */
+    template <typename E>
+    void evaluate(const Plan<E> &plan, const FieldLayout &layout, double *out, size_t n)
+    {
+        const E &expr = plan.expression();
+        const size_t *slots = plan.leafSlots().data();
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            FieldReader reader(layout, slots, i);
+            out[i] = expr.evaluate(reader);
+        }
+    }
+
+    template <typename E>
+    void evaluate(FunctionExpression<E> const& expr, const FieldLayout &layout,
+        double *out, size_t n)
+    {
+        evaluate(bind(expr, layout.getSchema()), layout, out, n);
+    }
+}
+
+#endif      // _BZBATCH_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,466 @@
+#include "benzaiten.hh"
+
+#include <new>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+using namespace benzaiten;
+
+/// Heap allocations made so far, counted to check that building expressions does not allocate
+static std::atomic<size_t> allocations(0);
+
+/// Every replaceable operator new comes here, so the count includes arrays and over-aligned types
+static void* allocate(size_t size, size_t alignment = 0)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+
+    if (size == 0) size = 1;
+    if (alignment > 0) size = (size + alignment - 1) / alignment * alignment;
+
+    if (void *p = (alignment > 0) ? std::aligned_alloc(alignment, size) : std::malloc(size)) return p;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size) { return allocate(size); }
+void* operator new[](size_t size) { return allocate(size); }
+
+void* operator new(size_t size, std::align_val_t al) { return allocate(size, static_cast<size_t>(al)); }
+void* operator new[](size_t size, std::align_val_t al) { return allocate(size, static_cast<size_t>(al)); }
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete[](void *p) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t) noexcept { std::free(p); }
+
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, std::align_val_t) noexcept { std::free(p); }
+
+void operator delete(void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+void operator delete[](void *p, size_t, std::align_val_t) noexcept { std::free(p); }
+
+template <typename F>
+void benchmark(const std::string &name, size_t n, F &&fn)
+{
+    double sink = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < n; ++i) sink += fn(i);
+
+    auto stop = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(stop - start).count() / n;
+
+    std::cout << "  " << name << ": " << ns << " ns/eval (checksum " << sink << ")" << std::endl;
+}
+
+/// Time building an expression, and count its heap allocations and size
+template <typename F>
+void construction(const std::string &name, size_t n, F &&fn)
+{
+    using E = decltype(fn());
+
+    size_t before = allocations.load();
+    auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        E e = fn();
+        asm volatile("" : : "g"(&e) : "memory");    // keep the result from being optimized away
+    }
+
+    auto stop = std::chrono::steady_clock::now();
+    double ns = std::chrono::duration<double, std::nano>(stop - start).count() / n;
+    double count = static_cast<double>(allocations.load() - before) / n;
+
+    std::cout << "  " << name << ": " << ns << " ns, " << count << " allocations, " << sizeof(E) << " bytes"
+        << (std::is_trivially_copyable<E>::value ? ", trivially copyable" : "") << std::endl;
+}
+
+int main()
+{
+    Variable t("t", Temporal), x("x", Spatial), y("y", Spatial);
+    Function f("f", t, x, y);
+    Function g("g", x, t);
+
+    const size_t n = 200000;
+
+    std::vector<SubstituteEntry> subs;
+    subs.push_back(SubstituteEntry("f", 1.5, { }));
+    subs.push_back(SubstituteEntry("f", 0.3, { { "x", 1 } }));
+    subs.push_back(SubstituteEntry("f", -0.2, { { "x", 2 } }));
+    subs.push_back(SubstituteEntry("g", 2, { }));
+    subs.push_back(SubstituteEntry("g", 0.4, { { "x", 1 } }));
+    subs.push_back(SubstituteEntry("g", 0.1, { { "x", 2 } }));
+    subs.push_back(SubstituteEntry("x", 5, { }));
+    subs.push_back(SubstituteEntry("t", 6, { }));
+
+    auto expr = (f ^ g).derivative<2>(x);
+
+    std::cout << "<<< d^2(f ^ g)/dx^2 >>>" << std::endl;
+
+    benchmark("expand", n / 10, [&](size_t) {
+        return (f ^ g).derivative<2>(x).isConcrete();
+    });
+
+    benchmark("substitute", n, [&](size_t) {
+        return expr.substitute(subs).getValue();
+    });
+
+    Context ctx(subs);
+
+    std::vector<double> in(subs.size());
+    for (size_t i = 0; i < subs.size(); ++i) in[i] = subs[i].value;
+
+    benchmark("evaluate", n, [&](size_t) {
+        return expr.evaluate(ctx);
+    });
+
+    benchmark("taylor", n, [&](size_t) {
+        return derivativeAt<2>(f ^ g, x, ctx);
+    });
+
+    Schema schema(subs);
+    auto plan = bind(expr, schema);
+
+    benchmark("plan", n, [&](size_t) {
+        return plan(in);
+    });
+
+    Tape tape = compile(expr, schema);
+
+    std::vector<double> r = tape.workspace();
+
+    std::cout << "  tape: " << tape.treeSize() << " tree nodes, " << tape.size() << " instructions, "
+        << tape.numRegisters() << " registers" << std::endl;
+
+    benchmark("tape", n, [&](size_t) {
+        return tape.evaluate(in.data(), r.data());
+    });
+
+    std::vector<double> w = tape.gradientWorkspace(), grad(in.size());
+
+    benchmark("tape gradient", n, [&](size_t) {
+        tape.gradient(in.data(), grad.data(), w.data());
+        return grad[0];
+    });
+
+    const size_t npts = 100000;
+    std::vector<std::vector<double>> fields(subs.size(), std::vector<double>(npts));
+    std::vector<double> out(npts);
+    FieldLayout layout(schema);
+
+    for (size_t i = 0; i < subs.size(); ++i)
+    {
+        for (size_t j = 0; j < npts; ++j) fields[i][j] = subs[i].value * (1 + 1e-7 * j);
+        layout.set(i, fields[i].data());
+    }
+
+    benchmark("grid of " + std::to_string(npts) + " points", 10, [&](size_t) {
+        evaluate(plan, layout, out.data(), npts);
+        return out[npts - 1];
+    });
+
+    // the same grid through the vectorized tape at each instruction set
+    // this machine supports
+    for (SimdLevel level : { SimdLevel::Baseline, SimdLevel::AVX2, SimdLevel::AVX512 })
+    {
+        if (level > detectSimd()) break;
+
+        benchmark(std::string("simd ") + simdLevelName(level), 10, [&](size_t) {
+            evaluate(tape, layout, out.data(), npts, level);
+            return out[npts - 1];
+        });
+    }
+
+    // the same grid through a native kernel; the second build is a cache hit
+    for (size_t pass = 0; pass < 2; ++pass)
+    {
+        auto start = std::chrono::steady_clock::now();
+        auto kernel = jit(expr, schema);
+        auto stop = std::chrono::steady_clock::now();
+
+        std::cout << "  jit: " << (kernel.isNative() ? (kernel.fromCache() ? "loaded from cache" :
+            "compiled") : "no compiler, using templates") << " in "
+            << std::chrono::duration<double, std::milli>(stop - start).count() << " ms" << std::endl;
+
+        if (pass == 0) continue;
+
+        benchmark("jit grid", 10, [&](size_t) {
+            kernel.evaluate(layout, out.data(), npts);
+            return out[npts - 1];
+        });
+    }
+
+    ThreadPool pool;
+
+    benchmark("grid on " + std::to_string(pool.size()) + " threads", 10, [&](size_t) {
+        evaluate(plan, layout, out.data(), npts, pool);
+        return out[npts - 1];
+    });
+
+    benchmark("simd on " + std::to_string(pool.size()) + " threads", 10, [&](size_t) {
+        evaluate(tape, layout, out.data(), npts, pool);
+        return out[npts - 1];
+    });
+
+    // Newton Jacobian of a two-field system with second-order stencils
+    SparseJacobian jac(Schema(), npts);
+    jac.unknown("f").unknown("g");
+
+    for (const char *name : { "f", "g" })
+    {
+        jac.stencil(name, { { "x", 1 } }, Stencil({ -1, 1 }, { -0.5, 0.5 }));
+        jac.stencil(name, { { "x", 2 } }, Stencil({ -1, 0, 1 }, { 1, -2, 1 }));
+    }
+
+    jac.equation(expr).equation(f * g - x);
+
+    const Schema &jacSchema = jac.getSchema();
+    std::vector<std::vector<double>> jacFields(jacSchema.size(), std::vector<double>(npts));
+    std::vector<double> residual(npts * jac.numEquations());
+    FieldLayout jacLayout(jacSchema);
+
+    for (size_t s = 0; s < jacSchema.size(); ++s)
+    {
+        double value = 0;
+
+        for (size_t k = 0; k < subs.size(); ++k)
+        {
+            if (schema.key(k) == jacSchema.key(s)) value = subs[k].value;
+        }
+
+        for (size_t j = 0; j < npts; ++j) jacFields[s][j] = value * (1 + 1e-7 * j);
+        jacLayout.set(s, jacFields[s].data());
+    }
+
+    std::cout << "  jacobian: " << jac.pattern().nonzeros() << " nonzeros in "
+        << jac.pattern().rows << " rows" << std::endl;
+
+    benchmark("jacobian of " + std::to_string(npts) + " points", 10, [&](size_t) {
+        return jac.assemble(jacLayout, residual.data()).values[0];
+    });
+
+    benchmark("jacobian on " + std::to_string(pool.size()) + " threads", 10, [&](size_t) {
+        return jac.assemble(jacLayout, pool, residual.data()).values[0];
+    });
+
+    // a Laplacian-like residual on a 2-d grid, with derivative fields
+    // computed and stored first, or computed inside the evaluation loop
+    {
+        const size_t nx = 400, ny = 250;
+        Grid grid;
+        grid.axis("x", nx, 0.01).axis("y", ny, 0.01);
+
+        auto fxx = f.derivative<2>(x), fyy = f.derivative<2>(y), fx = f.derivative(x);
+        auto heat = fxx + fyy - f * fx;
+
+        std::vector<double> fv(nx * ny), dxx(nx * ny), dyy(nx * ny), dx(nx * ny), res(nx * ny);
+        for (size_t j = 0; j < nx * ny; ++j) fv[j] = std::sin(0.01 * j);
+
+        FieldLayout base;
+        base.set("f", fv.data());
+
+        FieldLayout stored(base);
+        stored.set("f", { { "x", 2 } }, dxx.data()).set("f", { { "y", 2 } }, dyy.data())
+            .set("f", { { "x", 1 } }, dx.data());
+
+        auto storedPlan = bind(heat, stored.getSchema());
+
+        std::cout << "<<< f_xx + f_yy - f f_x on " << nx << " x " << ny << " points >>>" << std::endl;
+
+        benchmark("stored derivatives", 10, [&](size_t) {
+            evaluate(fxx, grid, base, dxx.data());
+            evaluate(fyy, grid, base, dyy.data());
+            evaluate(fx, grid, base, dx.data());
+            evaluate(storedPlan, stored, res.data(), nx * ny);
+            return res[nx + 1];
+        });
+
+        StencilPlan<decltype(heat)> fused(heat, grid, base);
+
+        benchmark("fused stencils", 10, [&](size_t) {
+            evaluate(fused, base, res.data());
+            return res[nx + 1];
+        });
+    }
+
+    // symbolic expansion against Taylor series at a higher order, where
+    // the derivative expression is much larger than the original
+    auto wave = sin(x * y) * exp(x) / (1 + x * x);
+    auto wave4 = wave.derivative<4>(x);
+
+    Context point;
+    point.set("x", 0.7).set("y", 1.3);
+
+    std::cout << "<<< d^4(sin(x y) exp(x) / (1 + x^2))/dx^4 >>>" << std::endl;
+
+    benchmark("symbolic, expand and evaluate", n / 10, [&](size_t) {
+        return derivativeAt<4, Differentiation::Symbolic>(wave, x, point);
+    });
+
+    benchmark("symbolic, evaluate", n, [&](size_t) {
+        return wave4.evaluate(point);
+    });
+
+    benchmark("taylor", n, [&](size_t) {
+        return derivativeAt<4>(wave, x, point);
+    });
+
+    // the same derivative as a runtime expression, built in a fresh arena
+    benchmark("runtime, expand and evaluate", n / 100, [&](size_t) {
+        DagArena arena;
+        return toDag(arena, wave).derivative<4>(x).evaluate(point);
+    });
+
+    DagArena arena;
+    DagExpression wave4Dag = toDag(arena, wave).derivative<4>(x);
+
+    std::cout << "  runtime: " << wave4Dag.numNodes() << " distinct nodes, " << arena.bytes() << " bytes" << std::endl;
+
+    benchmark("runtime, evaluate", n / 10, [&](size_t) {
+        return wave4Dag.evaluate(point);
+    });
+
+    ErasedExpression wave4Erased = erase(wave).derivative<4>(x);
+
+    benchmark("erased, evaluate", n, [&](size_t) {
+        return wave4Erased.evaluate(point);
+    });
+
+    // the same equation read from text: parse, differentiate, compile and
+    // evaluate once, as when it comes from a configuration file
+    benchmark("parsed, expand and evaluate", n / 100, [&](size_t) {
+        DagArena parsed;
+        auto e = parseExpression(parsed, "Variable x : Spatial, y : Spatial;"
+            "sin(x * y) * exp(x) / (1 + x ^ 2)");
+        return e->derivative("x", 4).evaluate(point);
+    });
+
+    std::vector<SubstituteEntry> pointEntries = { SubstituteEntry("x", 0.7, { }),
+        SubstituteEntry("y", 1.3, { }) };
+
+    benchmark("parsed, expand and compile", n / 1000, [&](size_t) {
+        DagArena parsed;
+        auto e = parseExpression(parsed, "Variable x : Spatial, y : Spatial;"
+            "sin(x * y) * exp(x) / (1 + x ^ 2)");
+        return compile(e->derivative("x", 4), pointEntries).evaluate(pointEntries);
+    });
+
+    // every trigonometric function of one argument shares one sin/cos pair
+    auto trig = (sin(f) * tan(g) + sech(f)).derivative<2>(x);
+    Tape trigTape = compile(trig, schema);
+    std::vector<double> trigRegs = trigTape.workspace(), trigW = trigTape.gradientWorkspace();
+
+    std::cout << "<<< d^2(sin(f) tan(g) + sech(f))/dx^2 >>>" << std::endl;
+    std::cout << "  tape: " << trigTape.treeSize() << " tree nodes, " << trigTape.size() << " instructions" << std::endl;
+
+    benchmark("evaluate", n, [&](size_t) {
+        return trig.evaluate(ctx);
+    });
+
+    benchmark("tape", n, [&](size_t) {
+        return trigTape.evaluate(in.data(), trigRegs.data());
+    });
+
+    benchmark("tape gradient", n, [&](size_t) {
+        trigTape.gradient(in.data(), grad.data(), trigW.data());
+        return grad[0];
+    });
+
+    benchmark(std::string("grid of ") + std::to_string(npts) + " points, simd " +
+        simdLevelName(detectSimd()), 10, [&](size_t) {
+        evaluate(trigTape, layout, out.data(), npts);
+        return out[npts - 1];
+    });
+
+    // whole and half-whole exponents avoid std::pow entirely
+    auto quintic = pow(f, 5.).derivative<2>(x);
+    auto quinticStatic = pow<5>(f).derivative<2>(x);
+    Exponent five(5), fourHalf(4.5);
+
+    std::cout << "<<< d^2(f^5)/dx^2 >>>" << std::endl;
+
+    benchmark("std::pow(u, 5)", n, [&](size_t i) {
+        return std::pow(1 + i * 1e-9, 5.);
+    });
+
+    benchmark("reduced u^5", n, [&](size_t i) {
+        return five(1 + i * 1e-9);
+    });
+
+    benchmark("std::pow(u, 4.5)", n, [&](size_t i) {
+        return std::pow(1 + i * 1e-9, 4.5);
+    });
+
+    benchmark("reduced u^4.5", n, [&](size_t i) {
+        return fourHalf(1 + i * 1e-9);
+    });
+
+    benchmark("runtime exponent, evaluate", n, [&](size_t) {
+        return quintic.evaluate(ctx);
+    });
+
+    benchmark("compile-time exponent, evaluate", n, [&](size_t) {
+        return quinticStatic.evaluate(ctx);
+    });
+
+    Tape quinticTape = compile(quintic, subs);
+
+    benchmark("tape", n, [&](size_t) {
+        return quinticTape.evaluate(in.data());
+    });
+
+    // a subexpression used three times, copied into each use or shared
+    auto usage = f * g;
+    auto usageShared = ref(f * g);
+
+    auto copied = (sin(usage) + usage * exp(usage)).derivative<2>(x);
+    auto shared = (sin(usageShared) + usageShared * exp(usageShared)).derivative<2>(x);
+
+    std::cout << "<<< d^2(sin(u) + u exp(u))/dx^2, u = f g >>>" << std::endl;
+    std::cout << "  copied: " << sizeof(copied) << " bytes, " << compile(copied, subs).treeSize() << " tree nodes" << std::endl;
+    std::cout << "  shared: " << sizeof(shared) << " bytes, " << compile(shared, subs).treeSize() << " tree nodes" << std::endl;
+
+    benchmark("copied, evaluate", n, [&](size_t) {
+        return copied.evaluate(ctx);
+    });
+
+    benchmark("shared, evaluate", n, [&](size_t) {
+        return shared.evaluate(ctx);
+    });
+
+    benchmark("copied, compile", n / 100, [&](size_t) {
+        return compile(copied, subs).evaluate(in.data());
+    });
+
+    benchmark("shared, compile", n / 100, [&](size_t) {
+        return compile(shared, subs).evaluate(in.data());
+    });
+
+    // names too long to be stored inline in a std::string
+    Variable time("time_coordinate", Temporal), space("space_coordinate", Spatial);
+    Function u("velocity_field", time, space), v("pressure_field", space, time);
+
+    std::cout << "<<< building and differentiating >>>" << std::endl;
+
+    construction("d(u csc(v))/dx", n, [&]() {
+        return (u * csc(v)).derivative(space);
+    });
+
+    construction("d((3 / sqrt(1 / x^3)) u sqrt(x))/dx", n, [&]() {
+        return ((3. / sqrt(1. / (space ^ 3))) * u * sqrt(space)).derivative(space);
+    });
+
+    construction("d^3((3 / sqrt(1 / x^3)) u sqrt(x))/dx^3", n / 10, [&]() {
+        return ((3. / sqrt(1. / (space ^ 3))) * u * sqrt(space)).derivative<3>(space);
+    });
+
+    construction("d(x d(x t^2)/dx)/dx", n, [&]() {
+        return (space * (space * (time ^ 2)).derivative(space)).derivative(space);
+    });
+
+    return 0;
+}
+
+// vim: set ft=cpp.doxygen:
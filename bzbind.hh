@@ -0,0 +1,204 @@
+#ifndef _BZBIND_HH_
+#define _BZBIND_HH_
+
+#include "bzexpression.hh"
+#include "bzvariable.hh"
+#include "bzfunction.hh"
+
+#include <limits>
+
+namespace benzaiten
+{
+    /**
+     * Assignment of variables and function derivatives to integer slots in
+     * an array of values. Leaves are resolved against a schema once, when an
+     * expression is bound or compiled, rather than on every evaluation.
+     */
+    struct Schema
+    {
+        static constexpr size_t npos = std::numeric_limits<size_t>::max();
+
+        Schema() { }
+
+        /**
+         * Slot `i` holds the value of `entries[i]`. As with substitution, the
+         * first of several matching entries wins.
+         */
+        Schema(const std::vector<SubstituteEntry> &entries)
+        {
+            for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+            {
+                std::string key = leafKey(it->name, it->d);
+
+                keys.push_back(key);
+                slots.emplace(key, keys.size() - 1);
+            }
+        }
+
+        /// @return The slot of the named function derivative or variable
+        size_t add(const std::string &name,
+            const std::unordered_map<std::string, size_t> &d = { })
+        {
+            return addKey(leafKey(name, d));
+        }
+
+        size_t add(const Variable &vbl)
+        {
+            return add(vbl.getName());
+        }
+
+        /// @return The slot of the leaf with a canonical key, see leafKey
+        size_t addKey(const std::string &key)
+        {
+            auto it = slots.find(key);
+
+            if (it != slots.end()) return it->second;
+
+            keys.push_back(key);
+            slots[key] = keys.size() - 1;
+            return keys.size() - 1;
+        }
+
+        size_t size() const { return keys.size(); }
+
+        /// @return Canonical key of a slot, see leafKey
+        const std::string& key(size_t slot) const { return keys[slot]; }
+
+        /// @return The slot of the variable or function, or npos if it is not bound
+        template <typename L>
+        size_t find(const L &leaf) const
+        {
+            return findKey(leaf.key());
+        }
+
+        /// @return The slot of the leaf with a canonical key, or npos
+        size_t findKey(const std::string &key) const
+        {
+            auto it = slots.find(key);
+            return (it == slots.end()) ? npos : it->second;
+        }
+
+        private:
+            std::vector<std::string> keys;
+            std::unordered_map<std::string, size_t> slots;
+    };
+
+    /**
+     * Context recording the slot of each leaf, in the order `evaluate`
+     * visits them.
+     */
+    struct SlotRecorder
+    {
+        SlotRecorder(const Schema &schema) : schema(schema) { }
+
+        double constant(double value) const { return value; }
+
+        template <typename L>
+        double lookup(const L &leaf) const
+        {
+            slots.push_back(schema.find(leaf));
+            return 0;
+        }
+
+        const Schema &schema;
+        mutable std::vector<size_t> slots;
+    };
+
+    /// Context adding a slot for every leaf that does not have one yet
+    struct SlotAllocator
+    {
+        SlotAllocator(Schema &schema) : schema(schema) { }
+
+        double constant(double value) const { return value; }
+
+        template <typename L>
+        double lookup(const L &leaf) const
+        {
+            schema.addKey(leaf.key());
+            return 0;
+        }
+
+        Schema &schema;
+    };
+
+    /**
+     * Context replaying recorded slots; each leaf is a single array load.
+     * Leaves without a slot evaluate to NaN.
+     */
+    struct SlotReader
+    {
+        SlotReader(const double *values, const size_t *slots) :
+            values(values), cursor(slots) { }
+
+        double constant(double value) const { return value; }
+
+        template <typename L>
+        double lookup(const L &) const
+        {
+            size_t slot = *cursor++;
+
+            if (slot == Schema::npos) return std::numeric_limits<double>::quiet_NaN();
+            return values[slot];
+        }
+
+        const double *values;
+        mutable const size_t *cursor;
+    };
+
+    /**
+     * An expression whose leaves have been resolved against a schema. The
+     * plan is immutable, so a single plan may be evaluated concurrently.
+     */
+    template <typename E>
+    struct Plan
+    {
+        Plan(const E &expr, const Schema &schema) : expr(expr)
+        {
+            SlotRecorder recorder(schema);
+            expr.evaluate(recorder);
+            slots = recorder.slots;
+        }
+
+        /// Evaluate with `values[i]` holding the value of slot `i`
+        double operator()(const double *values) const
+        {
+            SlotReader reader(values, slots.data());
+            return expr.evaluate(reader);
+        }
+
+        double operator()(const std::vector<double> &values) const
+        {
+            return (*this)(values.data());
+        }
+
+        /// @return Whether every leaf has a slot in the schema
+        bool complete() const
+        {
+            for (size_t slot : slots)
+            {
+                if (slot == Schema::npos) return false;
+            }
+
+            return true;
+        }
+
+        const E& expression() const { return expr; }
+
+        /// @return The slot of each leaf, in evaluation order
+        const std::vector<size_t>& leafSlots() const { return slots; }
+
+        private:
+            E expr;
+            std::vector<size_t> slots;
+    };
+
+    template <typename E>
+    Plan<E> bind(FunctionExpression<E> const& expr, const Schema &schema)
+    {
+        return Plan<E>(static_cast<E const&>(expr), schema);
+    }
+}
+
+#endif      // _BZBIND_HH_
+
+// vim: set ft=cpp.doxygen:
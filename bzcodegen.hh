@@ -0,0 +1,272 @@
+#ifndef _BZCODEGEN_HH_
+#define _BZCODEGEN_HH_
+
+#include "bzbind.hh"
+#include "bztape.hh"
+
+#include <cmath>
+#include <cctype>
+#include <string>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <unordered_set>
+
+namespace benzaiten
+{
+    /// @return The input slots a tape reads, in increasing order
+    inline std::vector<size_t> kernelArguments(const Tape &tape)
+    {
+        std::vector<size_t> slots;
+
+        for (const TapeInstruction &ins : tape.tracedInstructions())
+        {
+            if (ins.op == TapeOp::Load) slots.push_back(ins.a);
+        }
+
+        std::sort(slots.begin(), slots.end());
+        slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+
+        return slots;
+    }
+
+    /// Emits the statements of one generated kernel
+    struct CodeWriter
+    {
+        CodeWriter(const Tape &tape, const Schema &schema) : tape(tape), schema(schema) { }
+
+        /**
+         * @return C identifier for the array of a slot, such as `f_xyy` for
+         * the key `f;x^1;y^2`; later slots that would collide get a suffix
+         */
+        std::string identifier(size_t slot)
+        {
+            std::map<std::string, size_t> d;
+            std::string id;
+
+            for (char c : parseLeafKey(schema.key(slot), d)) id += cIdentifierChar(c);
+            if (!d.empty()) id += "_";
+
+            for (auto it = d.cbegin(); it != d.cend(); ++it)
+            {
+                for (size_t k = 0; k < it->second; ++k)
+                {
+                    for (char c : it->first) id += cIdentifierChar(c);
+                }
+            }
+
+            if (id.empty() || std::isdigit(static_cast<unsigned char>(id[0])) || reserved(id)) id = "in_" + id;
+            if (!used.insert(id).second) id += "_" + std::to_string(slot);
+
+            return id;
+        }
+
+        /// Write the loop body computing `out[k]`
+        void body(std::ostream &os, const std::vector<std::string> &args)
+        {
+            const std::vector<TapeInstruction> &code = tape.tracedInstructions();
+
+            // only values the result depends on are written
+            std::vector<bool> live(code.size(), false);
+            live[tape.tracedResult()] = true;
+
+            for (size_t i = code.size(); i-- > 0; )
+            {
+                if (!live[i]) continue;
+
+                size_t arity = tapeOpArity(code[i].op);
+                if (arity > 0) live[code[i].a] = true;
+                if (arity > 1) live[code[i].b] = true;
+            }
+
+            values.assign(code.size(), std::string());
+
+            for (size_t i = 0; i < code.size(); ++i)
+            {
+                if (!live[i]) continue;
+
+                const TapeInstruction &ins = code[i];
+                std::string t = "t" + std::to_string(i);
+
+                if (ins.op == TapeOp::Const)
+                {
+                    values[i] = literal(tape.constantTable()[ins.a]);
+                    continue;
+                }
+
+                values[i] = t;
+
+                size_t arity = tapeOpArity(ins.op);
+                std::string a = (arity > 0) ? values[ins.a] : std::string();
+                std::string b = (arity > 1) ? values[ins.b] : std::string();
+                std::string rhs;
+
+                switch (ins.op)
+                {
+                    case TapeOp::Load:  rhs = args[ins.a] + "[k]"; break;
+                    case TapeOp::Add:   rhs = a + " + " + b; break;
+                    case TapeOp::Sub:   rhs = a + " - " + b; break;
+                    case TapeOp::Mul:   rhs = (a == "1.0") ? b : ((b == "1.0") ? a : a + " * " + b); break;
+                    case TapeOp::Div:   rhs = a + " / " + b; break;
+                    case TapeOp::Neg:   rhs = "(-" + a + ")"; break;
+                    case TapeOp::Pow:   rhs = power(os, t, a, code[ins.b], b); break;
+                    case TapeOp::Sqrt:  rhs = "sqrt(" + a + ")"; break;
+                    case TapeOp::Log:   rhs = "log(" + a + ")"; break;
+                    case TapeOp::Exp:   rhs = "exp(" + a + ")"; break;
+                    case TapeOp::Sin:   rhs = "sin(" + a + ")"; break;
+                    case TapeOp::Cos:   rhs = "cos(" + a + ")"; break;
+                    case TapeOp::Tan:   rhs = "tan(" + a + ")"; break;
+                    case TapeOp::Cot:   rhs = "1.0 / tan(" + a + ")"; break;
+                    case TapeOp::Sec:   rhs = "1.0 / cos(" + a + ")"; break;
+                    case TapeOp::Csc:   rhs = "1.0 / sin(" + a + ")"; break;
+                    case TapeOp::Sinh:  rhs = "sinh(" + a + ")"; break;
+                    case TapeOp::Cosh:  rhs = "cosh(" + a + ")"; break;
+                    case TapeOp::Tanh:  rhs = "tanh(" + a + ")"; break;
+                    case TapeOp::Coth:  rhs = "1.0 / tanh(" + a + ")"; break;
+                    case TapeOp::Sech:  rhs = "1.0 / cosh(" + a + ")"; break;
+                    case TapeOp::Csch:  rhs = "1.0 / sinh(" + a + ")"; break;
+                    case TapeOp::Const:
+                    case TapeOp::SinCos:
+                    case TapeOp::SinhCosh: break;
+                }
+
+                // copies, such as a first power, need no temporary
+                if (rhs.find_first_of(" ([") == std::string::npos) values[i] = rhs;
+                else os << "        const double " << t << " = " << rhs << ";" << std::endl;
+            }
+
+            os << "        out[k] = " << values[tape.tracedResult()] << ";" << std::endl;
+        }
+
+        /// @return A C literal that reads back as exactly `value`
+        static std::string literal(double value)
+        {
+            if (std::isnan(value)) return "NAN";
+            if (std::isinf(value)) return (value < 0) ? "(-INFINITY)" : "INFINITY";
+
+            std::ostringstream ss;
+            ss << std::setprecision(17) << value;
+
+            std::string s = ss.str();
+            if (s.find_first_of(".e") == std::string::npos) s += ".0";
+            if (value < 0) s = "(" + s + ")";
+
+            return s;
+        }
+
+        private:
+            /// @return Whether a name is taken by the kernel, math.h or C itself
+            static bool reserved(const std::string &id)
+            {
+                static const std::unordered_set<std::string> names = { "n", "k", "out",
+                    "size_t", "double", "const", "restrict", "for", "return", "void",
+                    "int", "if", "else", "while", "do", "auto", "sizeof", "pow", "sqrt",
+                    "log", "exp", "sin", "cos", "tan", "sinh", "cosh", "tanh",
+                    "NAN", "INFINITY" };
+
+                // temporaries are t followed by digits and underscores
+                if ((id[0] == 't') && (id.size() > 1) &&
+                    (id.find_first_not_of("0123456789_", 1) == std::string::npos)) return true;
+
+                return names.count(id) > 0;
+            }
+
+            static char cIdentifierChar(char c)
+            {
+                return std::isalnum(static_cast<unsigned char>(c)) ? c : '_';
+            }
+
+            /**
+             * Whole exponents up to 64 become products by repeated squaring,
+             * and halves become square roots; anything else calls `pow`.
+             */
+            std::string power(std::ostream &os, const std::string &t,
+                const std::string &base, const TapeInstruction &exponent,
+                const std::string &e)
+            {
+                if (exponent.op != TapeOp::Const) return "pow(" + base + ", " + e + ")";
+
+                double p = tape.constantTable()[exponent.a];
+
+                if (p == 0.5) return "sqrt(" + base + ")";
+                if (p == -0.5) return "1.0 / sqrt(" + base + ")";
+                if ((p != std::floor(p)) || (std::fabs(p) > 64)) return "pow(" + base + ", " + e + ")";
+
+                size_t m = static_cast<size_t>(std::fabs(p)), step = 0;
+                std::string square = base, product;
+
+                while (m > 0)
+                {
+                    if (m & 1) product = product.empty() ? square : product + " * " + square;
+                    m >>= 1;
+
+                    if (m > 0)
+                    {
+                        std::string next = t + "_" + std::to_string(step++);
+                        os << "        const double " << next << " = " << square << " * " << square << ";" << std::endl;
+                        square = next;
+                    }
+                }
+
+                if (product.empty()) return "1.0";
+                if (p > 0) return product;
+                return (product == square) ? "1.0 / " + product : "1.0 / (" + product + ")";
+            }
+
+            const Tape &tape;
+            const Schema &schema;
+
+            std::vector<std::string> values;
+            std::unordered_set<std::string> used;
+    };
+
+    /**
+     * @return Source of a standalone C99 function evaluating a compiled
+     * expression at `n` points,
+     *
+     *     void name(size_t n, const double *f, const double *f_x, ..., double *out)
+     *
+     * with one array argument per slot the expression reads, in the order
+     * given by `kernelArguments`. The body is straight-line code with one
+     * temporary per distinct subexpression, as found when compiling.
+     */
+    inline std::string generateC(const Tape &tape, const Schema &schema, const std::string &name)
+    {
+        CodeWriter writer(tape, schema);
+        std::vector<std::string> args(schema.size());
+
+        std::ostringstream os;
+        os << "#include <math.h>" << std::endl;
+        os << "#include <stddef.h>" << std::endl << std::endl;
+        os << "void " << name << "(size_t n";
+
+        for (size_t slot : kernelArguments(tape))
+        {
+            args[slot] = writer.identifier(slot);
+            os << "," << std::endl << "    const double *restrict " << args[slot];
+        }
+
+        os << "," << std::endl << "    double *restrict out)" << std::endl;
+        os << "{" << std::endl;
+        os << "    for (size_t k = 0; k < n; ++k)" << std::endl;
+        os << "    {" << std::endl;
+
+        writer.body(os, args);
+
+        os << "    }" << std::endl;
+        os << "}" << std::endl;
+
+        return os.str();
+    }
+
+    template <typename E>
+    std::string generateC(FunctionExpression<E> const& expr, const Schema &schema,
+        const std::string &name)
+    {
+        return generateC(compile(expr, schema), schema, name);
+    }
+}
+
+#endif      // _BZCODEGEN_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,55 @@
+#ifndef _BZCONTEXT_HH_
+#define _BZCONTEXT_HH_
+
+#include "bzexpression.hh"
+#include "bzvariable.hh"
+#include "bzfunction.hh"
+
+#include <limits>
+
+namespace benzaiten
+{
+    /**
+     * Values for the variables and functions of an expression, used by
+     * `evaluate` to compute a number without copying or modifying the
+     * expression. Entries are matched exactly as in `substituteInPlace`.
+     *
+     * Any object with the same `constant` and `lookup` members can be passed
+     * to `evaluate` in place of a Context; the leaves of the expression call
+     * `lookup` and every constant is passed through `constant`.
+     */
+    struct Context
+    {
+        Context() { }
+
+        Context(const std::vector<SubstituteEntry> &entries) : entries(entries) { }
+
+        Context& set(const std::string &name, double value,
+            const std::unordered_map<std::string, size_t> &d = { })
+        {
+            entries.push_back(SubstituteEntry(name, value, d));
+            return *this;
+        }
+
+        double constant(double value) const { return value; }
+
+        /// @return The value of the variable or function, or NaN if it is not bound
+        template <typename L>
+        double lookup(const L &leaf) const
+        {
+            for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+            {
+                if (leaf == *it) return it->value;
+            }
+
+            return std::numeric_limits<double>::quiet_NaN();
+        }
+
+        private:
+            std::vector<SubstituteEntry> entries;
+    };
+}
+
+#endif      // _BZCONTEXT_HH_
+
+// vim: set ft=cpp.doxygen:
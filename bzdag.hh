@@ -0,0 +1,928 @@
+#ifndef _BZDAG_HH_
+#define _BZDAG_HH_
+
+#include "bzexpression.hh"
+#include "bzvariable.hh"
+#include "bzfunction.hh"
+#include "bzstatic.hh"
+#include "bztrig.hh"
+#include "bzhyperbolic.hh"
+
+#include <cmath>
+#include <mutex>
+#include <memory>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <functional>
+#include <unordered_set>
+#include <unordered_map>
+
+namespace benzaiten
+{
+    enum class DagOp : uint8_t
+    {
+        Constant,
+        Variable,
+        Function,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Neg,
+        Pow,
+        Log,
+        Exp,
+        Sin,
+        Cos,
+        Tan,
+        Cot,
+        Sec,
+        Csc,
+        Sinh,
+        Cosh,
+        Tanh,
+        Coth,
+        Sech,
+        Csch
+    };
+
+    inline size_t dagOpArity(DagOp op)
+    {
+        switch (op)
+        {
+            case DagOp::Constant:
+            case DagOp::Variable:
+            case DagOp::Function:
+                return 0;
+
+            case DagOp::Add:
+            case DagOp::Sub:
+            case DagOp::Mul:
+            case DagOp::Div:
+            case DagOp::Pow:
+                return 2;
+
+            default:
+                return 1;
+        }
+    }
+
+    /// An argument of a function leaf and the order of the derivative by it
+    struct DagArgument
+    {
+        const std::string *name;
+        size_t order;
+    };
+
+    /**
+     * A node of a runtime expression. Nodes are immutable and unique within
+     * their arena, so equal subexpressions are the same node and can be
+     * compared by address.
+     */
+    struct DagNode
+    {
+        DagOp op;
+        uint32_t id;                    ///< Position in the arena, in order of creation
+        size_t hash;
+
+        const DagNode *a, *b;           ///< Operands, or null
+        double value;                   ///< Value of a constant
+
+        const std::string *name;        ///< Interned name of a variable or function
+        VariableType type;              ///< Kind of a variable
+        const DagArgument *args;        ///< Arguments of a function
+        size_t numArgs;
+    };
+
+    /// A node in the evaluation order of an expression, with its operands by position in that order
+    struct DagStep
+    {
+        const DagNode *node;
+        uint32_t a, b;
+    };
+
+    /**
+     * Owner of the nodes of runtime expressions. Nodes are allocated from
+     * large blocks that are released together with the arena, and are
+     * hash-consed: asking for a node that already exists returns it, so
+     * every distinct subexpression is stored once. An arena is not safe to
+     * build in from several threads, but its nodes never change, so the
+     * expressions in it may be evaluated concurrently.
+     */
+    struct DagArena
+    {
+        DagArena(size_t blockSize = 1 << 16) : blockSize(blockSize) { }
+
+        DagArena(const DagArena&) = delete;
+        DagArena& operator=(const DagArena&) = delete;
+
+        const DagNode* constant(double value)
+        {
+            DagNode n = blank(DagOp::Constant);
+            n.value = (value == 0) ? 0 : value;     // one zero, whatever its sign
+
+            return intern(n);
+        }
+
+        const DagNode* variable(const std::string &name, VariableType type = Other)
+        {
+            DagNode n = blank(DagOp::Variable);
+            n.name = internName(name);
+            n.type = type;
+
+            return intern(n);
+        }
+
+        /// A function of the named variables, differentiated `d[v]` times by each `v`
+        const DagNode* function(const std::string &name, const std::vector<std::string> &args,
+            const std::unordered_map<std::string, size_t> &d = { })
+        {
+            std::vector<DagArgument> list;
+
+            for (const std::string &arg : args)
+            {
+                auto it = d.find(arg);
+                list.push_back({ internName(arg), (it == d.end()) ? 0 : it->second });
+            }
+
+            return function(internName(name), list.data(), list.size());
+        }
+
+        const DagNode* function(const std::string *name, const DagArgument *args, size_t numArgs)
+        {
+            DagNode n = blank(DagOp::Function);
+            n.name = name;
+            n.args = args;
+            n.numArgs = numArgs;
+
+            return intern(n);
+        }
+
+        /// @return The node applying an operation, without any simplification
+        const DagNode* node(DagOp op, const DagNode *a, const DagNode *b = nullptr)
+        {
+            DagNode n = blank(op);
+            n.a = a;
+            n.b = b;
+
+            return intern(n);
+        }
+
+        /// @return Number of distinct nodes
+        size_t size() const { return count; }
+
+        /// @return Bytes reserved for nodes
+        size_t bytes() const { return blocks.size() * blockSize; }
+
+        /**
+         * @return The nodes `root` reaches, each once and after its operands,
+         * so that evaluating an expression costs only what it reaches however
+         * large the arena; the order is found on first use and kept, and may
+         * be asked for from several threads
+         */
+        const std::vector<DagStep>& schedule(const DagNode *root)
+        {
+            std::lock_guard<std::mutex> lock(scheduleMutex);
+
+            auto found = schedules.find(root);
+            if (found != schedules.end()) return found->second;
+
+            std::vector<DagStep> &steps = schedules[root];
+            std::unordered_map<const DagNode*, uint32_t> position;
+
+            // depth first, first operand first, as a recursive evaluation would go
+            std::vector<std::pair<const DagNode*, bool>> stack = { { root, false } };
+
+            while (!stack.empty())
+            {
+                auto [n, expanded] = stack.back();
+                stack.pop_back();
+
+                if (position.count(n) > 0) continue;
+
+                if (!expanded && (n->a != nullptr))
+                {
+                    stack.push_back({ n, true });
+                    if (n->b != nullptr) stack.push_back({ n->b, false });
+                    stack.push_back({ n->a, false });
+                    continue;
+                }
+
+                uint32_t a = n->a ? position[n->a] : 0, b = n->b ? position[n->b] : 0;
+                position.emplace(n, static_cast<uint32_t>(steps.size()));
+                steps.push_back({ n, a, b });
+            }
+
+            return steps;
+        }
+
+        private:
+            friend struct DagExpression;
+
+            struct NodeHash
+            {
+                size_t operator()(const DagNode *n) const { return n->hash; }
+            };
+
+            struct NodeEqual
+            {
+                bool operator()(const DagNode *x, const DagNode *y) const
+                {
+                    if ((x->op != y->op) || (x->a != y->a) || (x->b != y->b) || (x->name != y->name) ||
+                        (x->type != y->type) || (x->numArgs != y->numArgs)) return false;
+
+                    if ((x->op == DagOp::Constant) &&
+                        (std::memcmp(&x->value, &y->value, sizeof(double)) != 0)) return false;
+
+                    for (size_t i = 0; i < x->numArgs; ++i)
+                    {
+                        if ((x->args[i].name != y->args[i].name) ||
+                            (x->args[i].order != y->args[i].order)) return false;
+                    }
+
+                    return true;
+                }
+            };
+
+            static DagNode blank(DagOp op)
+            {
+                return { op, 0, 0, nullptr, nullptr, 0, nullptr, Other, nullptr, 0 };
+            }
+
+            const DagNode* intern(DagNode &n)
+            {
+                uint64_t bits;
+                std::memcpy(&bits, &n.value, sizeof(double));
+
+                size_t h = std::hash<uint64_t>()(bits) ^ (static_cast<size_t>(n.op) * 0x9e3779b97f4a7c15ull);
+                auto mix = [&h](size_t v) { h ^= v + 0x9e3779b97f4a7c15ull + (h << 6) + (h >> 2); };
+
+                mix(n.a ? n.a->id : 0);
+                mix(n.b ? n.b->id : 0);
+                mix(std::hash<const void*>()(n.name));
+                mix(static_cast<size_t>(n.type));
+                for (size_t i = 0; i < n.numArgs; ++i) mix(std::hash<const void*>()(n.args[i].name) + n.args[i].order);
+
+                n.hash = h;
+
+                auto it = nodes.find(&n);
+                if (it != nodes.end()) return *it;
+
+                // copy the node, and the arguments of a function, into the arena
+                if (n.numArgs > 0)
+                {
+                    DagArgument *args = static_cast<DagArgument*>(allocate(n.numArgs * sizeof(DagArgument), alignof(DagArgument)));
+                    std::copy(n.args, n.args + n.numArgs, args);
+                    n.args = args;
+                }
+
+                DagNode *stored = static_cast<DagNode*>(allocate(sizeof(DagNode), alignof(DagNode)));
+                *stored = n;
+                stored->id = static_cast<uint32_t>(++count);
+
+                nodes.insert(stored);
+                return stored;
+            }
+
+            void* allocate(size_t size, size_t align)
+            {
+                used = (used + align - 1) / align * align;
+
+                if (blocks.empty() || (used + size > blockSize))
+                {
+                    blocks.emplace_back(new unsigned char[std::max(blockSize, size)]);
+                    used = 0;
+                }
+
+                void *p = blocks.back().get() + used;
+                used += size;
+
+                return p;
+            }
+
+            size_t blockSize;
+            size_t used = 0;
+            size_t count = 0;
+
+            std::vector<std::unique_ptr<unsigned char[]>> blocks;
+            std::unordered_set<const DagNode*, NodeHash, NodeEqual> nodes;
+
+            /// First derivatives already taken, by node and interned variable name
+            std::unordered_map<const DagNode*, std::unordered_map<const std::string*,
+                const DagNode*>> derivatives;
+
+            /// Evaluation orders already found, by root
+            std::unordered_map<const DagNode*, std::vector<DagStep>> schedules;
+            std::mutex scheduleMutex;
+    };
+
+    /**
+     * A leaf of a runtime expression as seen by an evaluation context; it
+     * matches substitution entries exactly as the template leaves do.
+     */
+    struct DagExpression;
+
+    struct DagLeaf
+    {
+        const DagNode *node;
+
+        /// Arena of the node, needed only to differentiate the leaf
+        DagArena *arena = nullptr;
+
+        /// @return The derivative of the leaf, for contexts such as a TaylorContext
+        template <size_t Order = 1, typename V = Variable>
+        DagExpression derivative(const V &var) const;
+
+        std::string key() const
+        {
+            std::unordered_map<std::string, size_t> d;
+            for (size_t i = 0; i < node->numArgs; ++i) d[*node->args[i].name] += node->args[i].order;
+
+            return leafKey(*node->name, d);
+        }
+
+        bool operator==(const SubstituteEntry &entry) const
+        {
+            if (*node->name != entry.name) return false;
+
+            for (size_t i = 0; i < node->numArgs; ++i)
+            {
+                auto it = entry.d.find(*node->args[i].name);
+                if (node->args[i].order != ((it == entry.d.end()) ? 0 : it->second)) return false;
+            }
+
+            return true;
+        }
+    };
+
+    DagExpression apply(DagOp op, const DagExpression &a, const DagExpression &b);
+
+    /**
+     * An expression whose structure is data rather than a type: a handle to
+     * a node of a DagArena, which must outlive it. It has the operations of
+     * the template expressions, so one type serves every equation, which
+     * keeps compile times bounded and lets equations be chosen at run time.
+     *
+     * The operators simplify as the template operators do, with zeros, ones
+     * and constants folded as the expression is built, and since nodes are
+     * shared, derivatives and evaluations visit each distinct subexpression
+     * once.
+     */
+    struct DagExpression : public FunctionExpression<DagExpression>
+    {
+        DagExpression(DagArena &arena, const DagNode *node) : arena(&arena), node(node) { }
+
+        DagArena& getArena() const { return *arena; }
+
+        const DagNode* getNode() const { return node; }
+
+        /// @return Derivative of order `order` by the named variable
+        DagExpression derivative(const std::string &var, size_t order = 1) const
+        {
+            const std::string *name = internName(var);
+            const DagNode *n = node;
+
+            for (size_t k = 0; k < order; ++k) n = differentiate(n, name).node;
+            return DagExpression(*arena, n);
+        }
+
+        DagExpression derivative(const char *var, size_t order = 1) const
+        {
+            return derivative(std::string(var), order);
+        }
+
+        template <size_t Order = 1, typename V = Variable>
+        DagExpression derivative(const V &var) const
+        {
+            return derivative(var.getName(), Order);
+        }
+
+        DagExpression& substituteInPlace(const std::vector<SubstituteEntry> &entries)
+        {
+            std::unordered_map<const DagNode*, const DagNode*> memo;
+            node = substitute(node, entries, memo);
+
+            return *this;
+        }
+
+        DagExpression substitute(const std::vector<SubstituteEntry> &entries) const
+        {
+            return DagExpression(*this).substituteInPlace(entries);
+        }
+
+        /**
+         * Evaluate in any context, such as a Context, a TapeBuilder or a
+         * SlotRecorder; each distinct subexpression is computed once.
+         */
+        template <typename C>
+        auto evaluate(const C &ctx) const
+        {
+            using V = decltype(ctx.constant(0.));
+
+            const std::vector<DagStep> &steps = arena->schedule(node);
+            std::vector<V> values;
+            values.reserve(steps.size());
+
+            for (const DagStep &step : steps) values.push_back(compute(step, ctx, values));
+            return values.back();
+        }
+
+        bool isConcrete() const { return node->op == DagOp::Constant; }
+
+        double getValue() const { return node->value; }
+
+        /// @return Number of distinct nodes the expression is built of
+        size_t numNodes() const
+        {
+            std::unordered_set<const DagNode*> seen;
+            std::vector<const DagNode*> stack = { node };
+
+            while (!stack.empty())
+            {
+                const DagNode *n = stack.back();
+                stack.pop_back();
+
+                if (!seen.insert(n).second) continue;
+                if (n->a) stack.push_back(n->a);
+                if (n->b) stack.push_back(n->b);
+            }
+
+            return seen.size();
+        }
+
+        friend std::ostream& operator<<(std::ostream &os, const DagExpression &expr)
+        {
+            print(os, expr.node);
+            return os;
+        }
+
+        private:
+            DagExpression wrap(const DagNode *n) const { return DagExpression(*arena, n); }
+
+            DagExpression differentiate(const DagNode *n, const std::string *var) const;
+
+            const DagNode* substitute(const DagNode *n, const std::vector<SubstituteEntry> &entries,
+                std::unordered_map<const DagNode*, const DagNode*> &memo) const
+            {
+                auto it = memo.find(n);
+                if (it != memo.end()) return it->second;
+
+                const DagNode *r = n;
+
+                if ((n->op == DagOp::Variable) || (n->op == DagOp::Function))
+                {
+                    for (auto e = entries.cbegin(); e != entries.cend(); ++e)
+                    {
+                        bool match = (n->op == DagOp::Variable) ? (e->name == *n->name) : (DagLeaf{ n } == *e);
+
+                        if (match)
+                        {
+                            r = arena->constant(e->value);
+                            break;
+                        }
+                    }
+                }
+                else if (n->op != DagOp::Constant)
+                {
+                    const DagNode *a = substitute(n->a, entries, memo);
+                    const DagNode *b = n->b ? substitute(n->b, entries, memo) : nullptr;
+
+                    if ((a != n->a) || (b != n->b)) r = apply(n->op, wrap(a), wrap(b ? b : a)).node;
+                }
+
+                memo.emplace(n, r);
+                return r;
+            }
+
+            template <typename C, typename V>
+            V compute(const DagStep &step, const C &ctx, const std::vector<V> &values) const
+            {
+                using std::log; using std::exp; using std::pow;
+                using std::sin; using std::cos; using std::tan;
+                using std::sinh; using std::cosh; using std::tanh;
+                using ::cot; using ::sec; using ::csc;
+                using ::coth; using ::sech; using ::csch;
+
+                const DagNode *n = step.node;
+
+                if (n->op == DagOp::Constant) return ctx.constant(n->value);
+                if ((n->op == DagOp::Variable) || (n->op == DagOp::Function)) return ctx.lookup(DagLeaf{ n, arena });
+
+                const V &a = values[step.a];
+                if (n->op == DagOp::Neg) return -a;
+
+                if (dagOpArity(n->op) == 2)
+                {
+                    const V &b = values[step.b];
+
+                    switch (n->op)
+                    {
+                        case DagOp::Add:    return a + b;
+                        case DagOp::Sub:    return a - b;
+                        case DagOp::Mul:    return a * b;
+                        case DagOp::Div:    return a / b;
+                        default:            return pow(a, b);
+                    }
+                }
+
+                switch (n->op)
+                {
+                    case DagOp::Log:    return log(a);
+                    case DagOp::Exp:    return exp(a);
+                    case DagOp::Sin:    return sin(a);
+                    case DagOp::Cos:    return cos(a);
+                    case DagOp::Tan:    return tan(a);
+                    case DagOp::Cot:    return cot(a);
+                    case DagOp::Sec:    return sec(a);
+                    case DagOp::Csc:    return csc(a);
+                    case DagOp::Sinh:   return sinh(a);
+                    case DagOp::Cosh:   return cosh(a);
+                    case DagOp::Tanh:   return tanh(a);
+                    case DagOp::Coth:   return coth(a);
+                    case DagOp::Sech:   return sech(a);
+                    default:            return csch(a);
+                }
+            }
+
+            static void print(std::ostream &os, const DagNode *n)
+            {
+                static const char *names[] = { "log", "exp", "sin", "cos", "tan", "cot",
+                    "sec", "csc", "sinh", "cosh", "tanh", "coth", "sech", "csch" };
+
+                switch (n->op)
+                {
+                    case DagOp::Constant: os << n->value; return;
+                    case DagOp::Variable: os << *n->name; return;
+
+                    case DagOp::Function:
+                    {
+                        size_t order = 0;
+                        for (size_t i = 0; i < n->numArgs; ++i) order += n->args[i].order;
+
+                        if (order > 1) os << "d^" << order << "(";
+                        else if (order > 0) os << "d(";
+
+                        os << *n->name << "(";
+                        for (size_t i = 0; i < n->numArgs; ++i) os << ((i > 0) ? ", " : "") << *n->args[i].name;
+                        os << ")";
+
+                        if (order > 0)
+                        {
+                            os << ")/";
+
+                            for (size_t i = 0; i < n->numArgs; ++i)
+                            {
+                                if (n->args[i].order == 0) continue;
+
+                                os << "d(" << *n->args[i].name << ")";
+                                if (n->args[i].order > 1) os << "^" << n->args[i].order;
+                                os << " ";
+                            }
+                        }
+
+                        return;
+                    }
+
+                    case DagOp::Add: os << "("; print(os, n->a); os << " + "; print(os, n->b); os << ")"; return;
+                    case DagOp::Sub: os << "("; print(os, n->a); os << " - "; print(os, n->b); os << ")"; return;
+                    case DagOp::Mul: os << "("; print(os, n->a); os << " * "; print(os, n->b); os << ")"; return;
+                    case DagOp::Div: os << "("; print(os, n->a); os << " / "; print(os, n->b); os << ")"; return;
+                    case DagOp::Pow: os << "("; print(os, n->a); os << " ^ "; print(os, n->b); os << ")"; return;
+                    case DagOp::Neg: os << "(-"; print(os, n->a); os << ")"; return;
+
+                    default:
+                        os << names[static_cast<size_t>(n->op) - static_cast<size_t>(DagOp::Log)] << "(";
+                        print(os, n->a);
+                        os << ")";
+                }
+            }
+
+            DagArena *arena;
+            const DagNode *node;
+    };
+
+    template <size_t Order, typename V>
+    DagExpression DagLeaf::derivative(const V &var) const
+    {
+        return DagExpression(*arena, node).derivative(var.getName(), Order);
+    }
+
+    /// @return Whether an expression is the constant `value`
+    inline bool isConstantValue(const DagExpression &e, double value)
+    {
+        return e.isConcrete() && (e.getValue() == value);
+    }
+
+    inline DagExpression operator+(const DagExpression &a, const DagExpression &b)
+    {
+        DagArena &arena = a.getArena();
+        assert(&arena == &b.getArena());
+
+        if (a.isConcrete() && b.isConcrete()) return DagExpression(arena, arena.constant(a.getValue() + b.getValue()));
+        if (isConstantValue(a, 0)) return b;
+        if (isConstantValue(b, 0)) return a;
+
+        return DagExpression(arena, arena.node(DagOp::Add, a.getNode(), b.getNode()));
+    }
+
+    inline DagExpression operator-(const DagExpression &a)
+    {
+        DagArena &arena = a.getArena();
+
+        if (a.isConcrete()) return DagExpression(arena, arena.constant(-a.getValue()));
+        if (a.getNode()->op == DagOp::Neg) return DagExpression(arena, a.getNode()->a);
+
+        return DagExpression(arena, arena.node(DagOp::Neg, a.getNode()));
+    }
+
+    inline DagExpression operator-(const DagExpression &a, const DagExpression &b)
+    {
+        DagArena &arena = a.getArena();
+        assert(&arena == &b.getArena());
+
+        if (a.isConcrete() && b.isConcrete()) return DagExpression(arena, arena.constant(a.getValue() - b.getValue()));
+        if (isConstantValue(b, 0)) return a;
+        if (isConstantValue(a, 0)) return -b;
+
+        return DagExpression(arena, arena.node(DagOp::Sub, a.getNode(), b.getNode()));
+    }
+
+    inline DagExpression operator*(const DagExpression &a, const DagExpression &b)
+    {
+        DagArena &arena = a.getArena();
+        assert(&arena == &b.getArena());
+
+        if (a.isConcrete() && b.isConcrete()) return DagExpression(arena, arena.constant(a.getValue() * b.getValue()));
+        if (isConstantValue(a, 0) || isConstantValue(b, 0)) return DagExpression(arena, arena.constant(0));
+        if (isConstantValue(a, 1)) return b;
+        if (isConstantValue(b, 1)) return a;
+
+        return DagExpression(arena, arena.node(DagOp::Mul, a.getNode(), b.getNode()));
+    }
+
+    inline DagExpression operator/(const DagExpression &a, const DagExpression &b)
+    {
+        DagArena &arena = a.getArena();
+        assert(&arena == &b.getArena());
+
+        if (a.isConcrete() && b.isConcrete()) return DagExpression(arena, arena.constant(a.getValue() / b.getValue()));
+        if (isConstantValue(a, 0)) return a;
+        if (isConstantValue(b, 1)) return a;
+
+        return DagExpression(arena, arena.node(DagOp::Div, a.getNode(), b.getNode()));
+    }
+
+    inline DagExpression pow(const DagExpression &a, const DagExpression &b)
+    {
+        DagArena &arena = a.getArena();
+        assert(&arena == &b.getArena());
+
+        if (a.isConcrete() && b.isConcrete()) return DagExpression(arena, arena.constant(std::pow(a.getValue(), b.getValue())));
+        if (isConstantValue(b, 0)) return DagExpression(arena, arena.constant(1));
+        if (isConstantValue(b, 1)) return a;
+
+        return DagExpression(arena, arena.node(DagOp::Pow, a.getNode(), b.getNode()));
+    }
+
+#define BZ_DAG_SCALAR(op) \
+    inline DagExpression operator op(const DagExpression &a, double b) \
+    { \
+        return a op DagExpression(a.getArena(), a.getArena().constant(b)); \
+    } \
+    \
+    inline DagExpression operator op(double a, const DagExpression &b) \
+    { \
+        return DagExpression(b.getArena(), b.getArena().constant(a)) op b; \
+    }
+
+    BZ_DAG_SCALAR(+)
+    BZ_DAG_SCALAR(-)
+    BZ_DAG_SCALAR(*)
+    BZ_DAG_SCALAR(/)
+
+#undef BZ_DAG_SCALAR
+
+    inline DagExpression pow(const DagExpression &a, double b)
+    {
+        return pow(a, DagExpression(a.getArena(), a.getArena().constant(b)));
+    }
+
+    inline DagExpression operator^(const DagExpression &a, const DagExpression &b) { return pow(a, b); }
+
+    inline DagExpression operator^(const DagExpression &a, double b) { return pow(a, b); }
+
+    inline DagExpression sqrt(const DagExpression &a) { return pow(a, 0.5); }
+
+#define BZ_DAG_UNARY(fn, op, eval) \
+    inline DagExpression fn(const DagExpression &a) \
+    { \
+        DagArena &arena = a.getArena(); \
+        \
+        if (a.isConcrete()) return DagExpression(arena, arena.constant(eval(a.getValue()))); \
+        return DagExpression(arena, arena.node(DagOp::op, a.getNode())); \
+    }
+
+    BZ_DAG_UNARY(log, Log, std::log)
+    BZ_DAG_UNARY(exp, Exp, std::exp)
+    BZ_DAG_UNARY(sin, Sin, std::sin)
+    BZ_DAG_UNARY(cos, Cos, std::cos)
+    BZ_DAG_UNARY(tan, Tan, std::tan)
+    BZ_DAG_UNARY(cot, Cot, ::cot)
+    BZ_DAG_UNARY(sec, Sec, ::sec)
+    BZ_DAG_UNARY(csc, Csc, ::csc)
+    BZ_DAG_UNARY(sinh, Sinh, std::sinh)
+    BZ_DAG_UNARY(cosh, Cosh, std::cosh)
+    BZ_DAG_UNARY(tanh, Tanh, std::tanh)
+    BZ_DAG_UNARY(coth, Coth, ::coth)
+    BZ_DAG_UNARY(sech, Sech, ::sech)
+    BZ_DAG_UNARY(csch, Csch, ::csch)
+
+#undef BZ_DAG_UNARY
+
+    /// @return The operation `op` applied to `a` and, if it takes two, `b`, simplified
+    inline DagExpression apply(DagOp op, const DagExpression &a, const DagExpression &b)
+    {
+        assert((dagOpArity(op) < 2) || (&a.getArena() == &b.getArena()));
+
+        switch (op)
+        {
+            case DagOp::Add:    return a + b;
+            case DagOp::Sub:    return a - b;
+            case DagOp::Mul:    return a * b;
+            case DagOp::Div:    return a / b;
+            case DagOp::Pow:    return pow(a, b);
+            case DagOp::Neg:    return -a;
+            case DagOp::Log:    return log(a);
+            case DagOp::Exp:    return exp(a);
+            case DagOp::Sin:    return sin(a);
+            case DagOp::Cos:    return cos(a);
+            case DagOp::Tan:    return tan(a);
+            case DagOp::Cot:    return cot(a);
+            case DagOp::Sec:    return sec(a);
+            case DagOp::Csc:    return csc(a);
+            case DagOp::Sinh:   return sinh(a);
+            case DagOp::Cosh:   return cosh(a);
+            case DagOp::Tanh:   return tanh(a);
+            case DagOp::Coth:   return coth(a);
+            case DagOp::Sech:   return sech(a);
+            case DagOp::Csch:   return csch(a);
+            default:            return a;
+        }
+    }
+
+    /// First derivative by an interned variable name, with the rules of the template nodes
+    inline DagExpression DagExpression::differentiate(const DagNode *n, const std::string *var) const
+    {
+        auto &memo = arena->derivatives[n];
+        auto it = memo.find(var);
+        if (it != memo.end()) return wrap(it->second);
+
+        DagExpression zero = wrap(arena->constant(0));
+        DagExpression r = zero;
+
+        switch (n->op)
+        {
+            case DagOp::Constant: break;
+
+            case DagOp::Variable:
+                if (n->name == var) r = wrap(arena->constant(1));
+                break;
+
+            case DagOp::Function:
+            {
+                std::vector<DagArgument> args(n->args, n->args + n->numArgs);
+
+                for (DagArgument &arg : args)
+                {
+                    if (arg.name != var) continue;
+
+                    ++arg.order;
+                    r = wrap(arena->function(n->name, args.data(), args.size()));
+                    break;
+                }
+
+                break;
+            }
+
+            default:
+            {
+                DagExpression a = wrap(n->a), da = differentiate(n->a, var);
+                DagExpression b = wrap(n->b ? n->b : n->a);
+
+                switch (n->op)
+                {
+                    case DagOp::Add:    r = da + differentiate(n->b, var); break;
+                    case DagOp::Sub:    r = da - differentiate(n->b, var); break;
+                    case DagOp::Neg:    r = -da; break;
+                    case DagOp::Mul:    r = da * b + a * differentiate(n->b, var); break;
+                    case DagOp::Div:    r = da / b - a * differentiate(n->b, var) / (b * b); break;
+
+                    case DagOp::Pow:
+                        if (b.isConcrete()) r = b * pow(a, b.getValue() - 1) * da;
+                        else r = pow(a, b - 1.) * (b * da + a * differentiate(n->b, var) * log(a));
+                        break;
+
+                    case DagOp::Log:    r = da / a; break;
+                    case DagOp::Exp:    r = exp(a) * da; break;
+                    case DagOp::Sin:    r = cos(a) * da; break;
+                    case DagOp::Cos:    r = -sin(a) * da; break;
+                    case DagOp::Tan:    r = sec(a) * sec(a) * da; break;
+                    case DagOp::Cot:    r = -csc(a) * csc(a) * da; break;
+                    case DagOp::Sec:    r = sec(a) * tan(a) * da; break;
+                    case DagOp::Csc:    r = -csc(a) * cot(a) * da; break;
+                    case DagOp::Sinh:   r = cosh(a) * da; break;
+                    case DagOp::Cosh:   r = sinh(a) * da; break;
+                    case DagOp::Tanh:   r = sech(a) * sech(a) * da; break;
+                    case DagOp::Coth:   r = -csch(a) * csch(a) * da; break;
+                    case DagOp::Sech:   r = -tanh(a) * sech(a) * da; break;
+                    case DagOp::Csch:   r = -coth(a) * csch(a) * da; break;
+                    default: break;
+                }
+            }
+        }
+
+        arena->derivatives[n].emplace(var, r.node);
+        return r;
+    }
+
+    /// Context turning a template expression into a runtime one, leaf by leaf
+    struct DagConverter
+    {
+        DagConverter(DagArena &arena) : arena(arena) { }
+
+        DagExpression constant(double value) const
+        {
+            return DagExpression(arena, arena.constant(value));
+        }
+
+        DagExpression lookup(const Variable &vbl) const
+        {
+            return DagExpression(arena, arena.variable(vbl.getName(), vbl.getType()));
+        }
+
+        template <typename Tag>
+        DagExpression lookup(const StaticVariable<Tag> &vbl) const
+        {
+            return DagExpression(arena, arena.variable(vbl.getName()));
+        }
+
+        /// @return The node of a subexpression shared by several parents, converted once
+        template <typename F>
+        DagExpression shared(const void *key, F &&compute) const
+        {
+            auto it = sharedNodes.find(key);
+            if (it != sharedNodes.end()) return DagExpression(arena, it->second);
+
+            DagExpression e = compute();
+            sharedNodes.emplace(key, e.getNode());
+
+            return e;
+        }
+
+        /// Leaves of a runtime expression, which may be in another arena
+        DagExpression lookup(const DagLeaf &leaf) const
+        {
+            const DagNode *n = leaf.node;
+
+            if (n->op == DagOp::Variable) return DagExpression(arena, arena.variable(*n->name, n->type));
+
+            std::vector<std::string> args;
+            std::unordered_map<std::string, size_t> d;
+
+            for (size_t i = 0; i < n->numArgs; ++i)
+            {
+                args.push_back(*n->args[i].name);
+                if (n->args[i].order > 0) d[args.back()] = n->args[i].order;
+            }
+
+            return DagExpression(arena, arena.function(*n->name, args, d));
+        }
+
+        /// Functions and their derivatives, template or static
+        template <typename L>
+        DagExpression lookup(const L &leaf) const
+        {
+            std::map<std::string, size_t> sorted;
+            std::string name = parseLeafKey(leaf.key(), sorted);
+
+            return DagExpression(arena, arena.function(name, leaf.arguments(),
+                std::unordered_map<std::string, size_t>(sorted.begin(), sorted.end())));
+        }
+
+        DagArena &arena;
+        mutable std::unordered_map<const void*, const DagNode*> sharedNodes;
+    };
+
+    /// @return The runtime form of a template expression, with its nodes in `arena`
+    template <typename E>
+    DagExpression toDag(DagArena &arena, FunctionExpression<E> const& expr)
+    {
+        return static_cast<E const&>(expr).evaluate(DagConverter(arena));
+    }
+}
+
+#endif      // _BZDAG_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,158 @@
+#ifndef _BZERASE_HH_
+#define _BZERASE_HH_
+
+#include "bzdag.hh"
+#include "bztape.hh"
+
+#include <mutex>
+#include <memory>
+#include <type_traits>
+
+namespace benzaiten
+{
+    /**
+     * An expression of any type behind one type, to stop the growth of the
+     * types of derivatives at a chosen point. It holds a runtime expression
+     * in an arena it shares with its copies and derivatives, so it can be
+     * passed around and stored freely.
+     *
+     * Evaluation in a context of plain values runs a tape compiled on first
+     * use, which reads every distinct leaf once; other contexts, such as a
+     * TapeBuilder or a TaylorContext, evaluate the runtime expression, so an
+     * erased expression can still take part in larger ones. A TaylorContext
+     * differentiates the leaves, which adds nodes to the arena, so it must
+     * not run while another thread builds in the same arena.
+     */
+    struct ErasedExpression : public FunctionExpression<ErasedExpression>
+    {
+        ErasedExpression(std::shared_ptr<DagArena> arena, const DagExpression &expr) :
+            arena(std::move(arena)), expr(expr), kernel(std::make_shared<Kernel>()) { }
+
+        /// @return Derivative of order `order` by the named variable
+        ErasedExpression derivative(const std::string &var, size_t order = 1) const
+        {
+            return ErasedExpression(arena, expr.derivative(var, order));
+        }
+
+        template <size_t Order = 1, typename V = Variable>
+        ErasedExpression derivative(const V &var) const
+        {
+            return derivative(var.getName(), Order);
+        }
+
+        ErasedExpression& substituteInPlace(const std::vector<SubstituteEntry> &entries)
+        {
+            expr.substituteInPlace(entries);
+            kernel = std::make_shared<Kernel>();
+
+            return *this;
+        }
+
+        ErasedExpression substitute(const std::vector<SubstituteEntry> &entries) const
+        {
+            return ErasedExpression(*this).substituteInPlace(entries);
+        }
+
+        template <typename C>
+        auto evaluate(const C &ctx) const
+        {
+            if constexpr (std::is_same<decltype(ctx.constant(0.)), double>::value)
+            {
+                // grows to the largest tape run on this thread, then is reused
+                thread_local std::vector<double> scratch;
+                return evaluate(ctx, scratch);
+            }
+            else return expr.evaluate(ctx);
+        }
+
+        /// Evaluation with plain values, using `workspace` for the leaves and registers
+        template <typename C>
+        double evaluate(const C &ctx, std::vector<double> &workspace) const
+        {
+            const Kernel &k = compiled();
+            const size_t size = k.leaves.size() + k.tape.numRegisters();
+
+            if (workspace.size() < size) workspace.resize(size);
+
+            for (size_t i = 0; i < k.leaves.size(); ++i)
+            {
+                workspace[i] = ctx.lookup(DagLeaf{ k.leaves[i], arena.get() });
+            }
+
+            return k.tape.evaluate(workspace.data(), workspace.data() + k.leaves.size());
+        }
+
+        bool isConcrete() const { return expr.isConcrete(); }
+
+        double getValue() const { return expr.getValue(); }
+
+        /// @return The runtime expression underneath
+        const DagExpression& expression() const { return expr; }
+
+        /// @return The tape that evaluates the expression, one input per leaf
+        const Tape& tape() const { return compiled().tape; }
+
+        friend std::ostream& operator<<(std::ostream &os, const ErasedExpression &erased)
+        {
+            return os << erased.expr;
+        }
+
+        private:
+            /// A tape and the leaf read into each of its input slots
+            struct Kernel
+            {
+                std::once_flag once;
+                std::vector<const DagNode*> leaves;
+                Tape tape;
+            };
+
+            const Kernel& compiled() const
+            {
+                std::call_once(kernel->once, [this]
+                {
+                    Schema schema;
+
+                    for (const DagStep &step : arena->schedule(expr.getNode()))
+                    {
+                        const DagNode *n = step.node;
+                        if ((n->op != DagOp::Variable) && (n->op != DagOp::Function)) continue;
+
+                        // leaves that differ only in the type of a variable share a slot
+                        size_t count = schema.size();
+                        schema.addKey(DagLeaf{ n }.key());
+                        if (schema.size() > count) kernel->leaves.push_back(n);
+                    }
+
+                    kernel->tape = compile(expr, schema);
+                });
+
+                return *kernel;
+            }
+
+            std::shared_ptr<DagArena> arena;
+            DagExpression expr;
+            std::shared_ptr<Kernel> kernel;
+    };
+
+    /**
+     * @return An expression of the fixed type ErasedExpression, with the
+     * same value and derivatives as `expr`; its nodes go into `arena`, so
+     * expressions erased into one arena share their common parts
+     */
+    template <typename E>
+    ErasedExpression erase(FunctionExpression<E> const& expr,
+        std::shared_ptr<DagArena> arena = std::make_shared<DagArena>())
+    {
+        DagExpression dag = toDag(*arena, expr);
+        return ErasedExpression(std::move(arena), dag);
+    }
+
+    inline ErasedExpression erase(const ErasedExpression &expr)
+    {
+        return expr;
+    }
+}
+
+#endif      // _BZERASE_HH_
+
+// vim: set ft=cpp.doxygen:
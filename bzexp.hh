@@ -12,34 +12,23 @@ namespace benzaiten
     template <typename E>
     struct FunctionExp;
 
-    template <typename F, size_t Order>
-    struct ExpDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionExp<F>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct ExpDerivativeType<F, 0>
-    {
-        using type = FunctionExp<F>;
-    };
-
     template <typename E>
     struct FunctionExp : public FunctionExpression<FunctionExp<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionExp<E>,
-                typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionExp(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename ExpDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return (exp(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
+                else return faaDiBruno<Order>(*this, fn, var);
+            }
+
+            template <size_t K>
+            FunctionExp<E> outerDerivative() const
+            {
+                return *this;
             }
 
             FunctionExp<E>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -60,6 +49,17 @@ namespace benzaiten
                 return FunctionExp<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::exp;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return exp(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
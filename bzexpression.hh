@@ -1,9 +1,12 @@
 #ifndef _BZEXPRESSION_HH_
 #define _BZEXPRESSION_HH_
 
+#include <map>
+#include <mutex>
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 
 namespace benzaiten
 {
@@ -12,6 +15,20 @@ namespace benzaiten
     {
     };
 
+    /**
+     * @return A pointer to a single shared copy of the name, which stays
+     * valid for the life of the program. Variables and functions refer to
+     * their names this way so that copying them never allocates.
+     */
+    inline const std::string* internName(const std::string &name)
+    {
+        static std::unordered_set<std::string> names;
+        static std::mutex mutex;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        return &(*names.insert(name).first);
+    }
+
     struct SubstituteEntry
     {
         SubstituteEntry(const std::string &name, double value,
@@ -27,6 +44,53 @@ namespace benzaiten
         double value;
         std::unordered_map<std::string, size_t> d;
     };
+
+    /**
+     * Canonical identity of a leaf: its name followed by the nonzero
+     * derivative orders, sorted by variable name.
+     */
+    inline std::string leafKey(const std::string &name,
+        const std::unordered_map<std::string, size_t> &d)
+    {
+        std::map<std::string, size_t> sorted;
+
+        for (auto it = d.cbegin(); it != d.cend(); ++it)
+        {
+            if (it->second > 0) sorted[it->first] = it->second;
+        }
+
+        std::string key = name;
+
+        for (auto it = sorted.cbegin(); it != sorted.cend(); ++it)
+        {
+            key += ";" + it->first + "^" + std::to_string(it->second);
+        }
+
+        return key;
+    }
+
+    /**
+     * Split a key made by leafKey back into the name, which is returned,
+     * and the derivative orders, which are written to `d`.
+     */
+    inline std::string parseLeafKey(const std::string &key, std::map<std::string, size_t> &d)
+    {
+        size_t i = key.find(';');
+        std::string name = key.substr(0, i);
+
+        d.clear();
+
+        while (i != std::string::npos)
+        {
+            size_t caret = key.find('^', i), next = key.find(';', i + 1);
+
+            d[key.substr(i + 1, caret - i - 1)] =
+                std::stoul(key.substr(caret + 1, next - caret - 1));
+            i = next;
+        }
+
+        return name;
+    }
 }
 
 #endif      // _BZEXPRESSION_HH_
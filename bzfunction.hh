@@ -4,313 +4,69 @@
 #include "bzexpression.hh"
 #include "bzvariable.hh"
 
-#include <tuple>
+#include <array>
+#include <cstdint>
+#include <type_traits>
 #include <string>
 #include <iostream>
 
 namespace benzaiten
 {
-    struct FunctionImpl
+    /**
+     * The constant zero, known to be zero from its type alone. Derivatives
+     * of leaves that cannot depend on a variable are Zero.
+     */
+    struct Zero : public FunctionExpression<Zero>
     {
-        virtual FunctionImpl* copy() const = 0;
-        virtual bool isFunctionOfVar(const Variable &var) const = 0;
-        virtual void print(std::ostream &os) const = 0;
-        virtual void incrementDerivative(const Variable &var, size_t order = 1) = 0;
-        virtual bool equals(const SubstituteEntry &subs) const = 0;
-        virtual bool concrete() const = 0;
-        virtual double value() const = 0;
-    };
-
-    template <typename... Args>
-    struct ConcreteFunctionImpl : public FunctionImpl
-    {
-        ConcreteFunctionImpl(double value) : _value(value) { }
-
-        ConcreteFunctionImpl* copy() const
-        {
-            return new ConcreteFunctionImpl<Args...>(_value);
-        }
-
-        bool isFunctionOfVar(const Variable &var) const
-        {
-            // never a function of anything
-            return false;
-        }
-
-        void incrementDerivative(const Variable &var, size_t order = 1)
-        {
-            if (order > 0) _value = 0;
-        }
-
-        void print(std::ostream &os) const
-        {
-            os << _value;
-        }
-
-        bool equals(const SubstituteEntry &subs) const
-        {
-            return false;
-        }
-
-        bool concrete() const
-        {
-            return true;
-        }
-
-        double value() const
-        {
-            return _value;
-        }
-
-        private:
-            double _value;
-    };
-
-    template <typename... Args>
-    struct NullFunctionImpl : public FunctionImpl
-    {
-        NullFunctionImpl* copy() const
+        template <size_t Order = 1, typename V = Variable>
+        Zero derivative(const V &var) const
         {
-            return new NullFunctionImpl<Args...>;
+            return *this;
         }
 
-        bool isFunctionOfVar(const Variable &var) const
+        Zero& substituteInPlace(const std::vector<SubstituteEntry> &)
         {
-            // never a function of anything
-            return false;
+            return *this;
         }
 
-        void incrementDerivative(const Variable &var, size_t order = 1)
+        Zero substitute(const std::vector<SubstituteEntry> &) const
         {
-            // do nothing
+            return *this;
         }
 
-        void print(std::ostream &os) const
+        template <typename C>
+        auto evaluate(const C &ctx) const
         {
-            os << "<null>";
+            return ctx.constant(0);
         }
 
-        bool equals(const SubstituteEntry &subs) const
-        {
-            return false;
-        }
+        bool isConcrete() const { return true; }
 
-        bool concrete() const
-        {
-            return true;
-        }
+        double getValue() const { return 0; }
 
-        double value() const
+        friend std::ostream& operator<<(std::ostream &os, const Zero &)
         {
-            return 0;
+            os << 0;
+            return os;
         }
     };
 
-    template <typename... Args>
-    struct AbstractFunctionImpl : public FunctionImpl
-    {
-        AbstractFunctionImpl* copy() const
-        {
-            return new AbstractFunctionImpl<Args...>(*this);
-        }
-
-        AbstractFunctionImpl(const std::string &name,
-            const std::tuple<Args...> &args) :
-                name(name), args(args)
-        {
-            for (size_t i = 0; i < sizeof...(Args); ++i) d[i] = 0;
-        }
-
-        bool isFunctionOfVar(const Variable &var) const
-        {
-            return isFunctionOfVarRecursive(var);
-        }
-
-        void incrementDerivative(const Variable &var, size_t order = 1)
-        {
-            incrementDerivativeRecursive(var, order);
-        }
-
-        void print(std::ostream &os) const
-        {
-            size_t order = totalDerivativeOrder();
-
-            if (order > 0)
-            {
-                if (order > 1) os << "d^" << order;
-                else os << "d";
-
-                os << "(";
-                os << name;
-                os << "(";
-                printArguments(os);
-                os << ")";
-                os << ")/";
-                printDerivatives(os);
-            }
-            else
-            {
-                os << name;
-                os << "(";
-                printArguments(os);
-                os << ")";
-            }
-        }
-
-        bool equals(const SubstituteEntry &subs) const
-        {
-            return (name == subs.name) && matchDerivativesRecursive(subs.d);
-        }
-
-        bool concrete() const
-        {
-            return false;
-        }
-
-        /**
-         * @attention This operation is not well-defined for an abstract function
-         * but is provided for a complete API.
-         */
-        double value() const
-        {
-            return 0;
-        }
-
-        private:
-            /// Store the arguments to this function
-            std::tuple<Args...> args;
-
-            /// Unique name of this function
-            std::string name;
-
-            /// Derivatives and orders
-            std::array<size_t, sizeof...(Args)> d;
-
-            template <size_t I = 0>
-            bool isFunctionOfVarRecursive(const Variable &var) const
-            {
-                if constexpr (I == sizeof...(Args))
-                {
-                    return false;
-                }
-                else if (std::get<I>(args).getName() == var.getName())
-                {
-                    return true;
-                }
-                else
-                {
-                    return isFunctionOfVarRecursive<I+1>(var);
-                }
-            }
-
-            template <size_t I = 0>
-            void incrementDerivativeRecursive(const Variable &var, size_t order = 1)
-            {
-                if constexpr (I == sizeof...(Args))
-                {
-                    return;
-                }
-                else if (std::get<I>(args).getName() == var.getName())
-                {
-                    d[I] += order;
-                }
-                else
-                {
-                    incrementDerivativeRecursive<I+1>(var, order);
-                }
-            }
-
-            template <size_t I = 0>
-            bool matchDerivativesRecursive(const std::unordered_map<std::string, size_t> &other) const
-            {
-                if constexpr (I == sizeof...(Args))
-                {
-                    return true;
-                }
-                else
-                {
-                    std::string vname = std::get<I>(args).getName();
-
-                    if (other.count(vname) == 0)
-                    {
-                        return (d[I] == 0) &&
-                            matchDerivativesRecursive<I+1>(other);
-                    }
-                    else
-                    {
-                        return (d[I] == other.at(vname)) &&
-                            matchDerivativesRecursive<I+1>(other);
-                    }
-                }
-            }
-
-            size_t totalDerivativeOrder() const
-            {
-                size_t order = 0;
-
-                for (size_t i = 0; i < sizeof...(Args); ++i)
-                {
-                    order += d[i];
-                }
-
-                return order;
-            }
-
-            template <size_t I = 0>
-            void printDerivatives(std::ostream &os) const
-            {
-                if constexpr (I == sizeof...(Args))
-                {
-                    return;
-                }
-                else
-                {
-                    if (d[I] > 0)
-                    {
-                        os << "d(" << std::get<I>(args).getName() << ")";
-                        if (d[I] > 1) os << "^" << d[I];
-                        os << " ";
-                    }
-
-                    printDerivatives<I+1>(os);
-                }
-            }
-
-            template <size_t I = 0>
-            void printArguments(std::ostream &os) const
-            {
-                if constexpr (I == sizeof...(Args))
-                {
-                    return;
-                }
-                else
-                {
-                    os << std::get<I>(args).getName();
-                    if constexpr (I < sizeof...(Args) - 1) os << ", ";
-                    printArguments<I+1>(os);
-                }
-            }
-    };
-
     struct Constant : public FunctionExpression<Constant>
     {
-        template <size_t Order>
-        using deriv_type = Constant;
-
         Constant(const double val) : value(val) { }
 
-        template <size_t Order = 1>
-        Constant& derivativeInPlace(const Variable &var)
+        template <size_t Order = 1, typename V = Variable>
+        Constant& derivativeInPlace(const V &var)
         {
             if constexpr (Order > 0) value = 0;
             return *this;
         }
 
-        template <size_t Order = 1>
-        Constant derivative(const Variable &var) const
+        template <size_t Order = 1, typename V = Variable>
+        auto derivative(const V &) const
         {
             if constexpr (Order == 0) return *this;
-            else return Constant(*this).derivativeInPlace<Order>(var);
+            else return Zero();
         }
 
         Constant& substituteInPlace(const std::vector<SubstituteEntry> &entries)
@@ -323,6 +79,12 @@ namespace benzaiten
             return Constant(*this).substituteInPlace(entries);
         }
 
+        template <typename C>
+        auto evaluate(const C &ctx) const
+        {
+            return ctx.constant(value);
+        }
+
         bool isConcrete() const { return true; }
 
         double getValue() const { return value; }
@@ -338,50 +100,91 @@ namespace benzaiten
             double value;
     };
 
-    template <typename... Args>
-    struct Function : public FunctionExpression<Function<Args...>>
+    /// The constant one, known to be one from its type alone
+    struct One : public FunctionExpression<One>
     {
-        template <size_t Order>
-        using deriv_type = Function<Args...>;
-
-        Function(const std::string &name, Args&... args)
+        template <size_t Order = 1, typename V = Variable>
+        auto derivative(const V &var) const
         {
-            impl = new AbstractFunctionImpl<Args...>(name, std::tuple<Args...>(args...));
+            if constexpr (Order == 0) return *this;
+            else return Zero();
         }
 
-        Function(const Function<Args...> &other)
+        One& substituteInPlace(const std::vector<SubstituteEntry> &)
         {
-            impl = other.impl->copy();
+            return *this;
         }
 
-        Function(Function<Args...> &&other)
+        One substitute(const std::vector<SubstituteEntry> &) const
         {
-            impl = other.impl;
-            other.impl = nullptr;
+            return *this;
         }
 
-        ~Function()
+        template <typename C>
+        auto evaluate(const C &ctx) const
         {
-            delete impl;
-            impl = nullptr;
+            return ctx.constant(1);
         }
 
-        Function<Args...>& operator=(const Function<Args...> &other)
+        bool isConcrete() const { return true; }
+
+        double getValue() const { return 1; }
+
+        friend std::ostream& operator<<(std::ostream &os, const One &)
         {
-            impl = other.impl->copy();
+            os << 1;
+            return os;
         }
+    };
+
+    template <typename E>
+    struct IsZero : public std::false_type { };
+
+    template <>
+    struct IsZero<Zero> : public std::true_type { };
+
+    template <typename E>
+    struct IsOne : public std::false_type { };
+
+    template <>
+    struct IsOne<One> : public std::true_type { };
+
+    /**
+     * Expressions whose value is known without any leaves; the operators
+     * fold these into a single Constant as the expression is built.
+     */
+    template <typename E>
+    struct IsConstant : public std::integral_constant<bool,
+        IsZero<E>::value || IsOne<E>::value> { };
+
+    template <>
+    struct IsConstant<Constant> : public std::true_type { };
+
+    /**
+     * An abstract function of the variables `Args`, or one of its
+     * derivatives. A function is a plain value: its name and the names of
+     * its arguments are interned, and the derivative orders are stored
+     * inline, so copies and moves never allocate.
+     */
+    template <typename... Args>
+    struct Function : public FunctionExpression<Function<Args...>>
+    {
+        Function(const std::string &name, Args&... vbls) :
+            name(internName(name)), args{ { vbls.internedName()... } } { }
 
         template <size_t Order = 1>
         Function<Args...>& derivativeInPlace(const Variable &var)
         {
-            if (impl->isFunctionOfVar(var))
+            size_t i = argument(var);
+
+            if ((state == State::Abstract) && (i < sizeof...(Args)))
             {
-                impl->incrementDerivative(var, Order);
+                d[i] += Order;
             }
             else
             {
-                delete impl;
-                impl = new NullFunctionImpl<Args...>();
+                state = State::Null;
+                _value = 0;
             }
 
             return *this;
@@ -400,8 +203,8 @@ namespace benzaiten
             {
                 if (*this == *it)
                 {
-                    delete impl;
-                    impl = new ConcreteFunctionImpl<Args...>(it->value);
+                    state = State::Concrete;
+                    _value = it->value;
                     break;
                 }
             }
@@ -414,31 +217,131 @@ namespace benzaiten
             return Function<Args...>(*this).substituteInPlace(entries);
         }
 
+        template <typename C>
+        auto evaluate(const C &ctx) const
+        {
+            if (isConcrete()) return ctx.constant(getValue());
+            return ctx.lookup(*this);
+        }
+
         bool operator==(const SubstituteEntry &entry) const
         {
-            return impl->equals(entry);
+            if ((state != State::Abstract) || (*name != entry.name)) return false;
+
+            for (size_t i = 0; i < sizeof...(Args); ++i)
+            {
+                auto it = entry.d.find(*args[i]);
+                if (d[i] != ((it == entry.d.end()) ? 0 : it->second)) return false;
+            }
+
+            return true;
+        }
+
+        /// @return Names of the variables this function depends on
+        std::vector<std::string> arguments() const
+        {
+            std::vector<std::string> names;
+            for (size_t i = 0; i < sizeof...(Args); ++i) names.push_back(*args[i]);
+            return names;
+        }
+
+        /// @return Identity of this function and its derivatives, see leafKey
+        std::string key() const
+        {
+            if (state != State::Abstract) return std::string();
+
+            std::unordered_map<std::string, size_t> orders;
+            for (size_t i = 0; i < sizeof...(Args); ++i) orders[*args[i]] += d[i];
+
+            return leafKey(*name, orders);
         }
 
         bool isConcrete() const
         {
-            return impl->concrete();
+            return state != State::Abstract;
         }
 
         double getValue() const
         {
-            return impl->value();
+            return _value;
         }
 
         friend std::ostream&
             operator<<(std::ostream &os, const Function<Args...> &fn)
         {
-            fn.impl->print(os);
+            if (fn.state == State::Concrete) os << fn._value;
+            else if (fn.state == State::Null) os << "<null>";
+            else
+            {
+                size_t order = 0;
+                for (size_t i = 0; i < sizeof...(Args); ++i) order += fn.d[i];
+
+                if (order > 0)
+                {
+                    if (order > 1) os << "d^" << order;
+                    else os << "d";
+
+                    os << "(";
+                }
+
+                os << *fn.name << "(";
+
+                for (size_t i = 0; i < sizeof...(Args); ++i)
+                {
+                    if (i > 0) os << ", ";
+                    os << *fn.args[i];
+                }
+
+                os << ")";
+
+                if (order > 0)
+                {
+                    os << ")/";
+
+                    for (size_t i = 0; i < sizeof...(Args); ++i)
+                    {
+                        if (fn.d[i] == 0) continue;
+
+                        os << "d(" << *fn.args[i] << ")";
+                        if (fn.d[i] > 1) os << "^" << fn.d[i];
+                        os << " ";
+                    }
+                }
+            }
+
             return os;
         }
 
         private:
-            /// Implementation pointer
-            FunctionImpl *impl;
+            enum class State : uint8_t
+            {
+                Abstract,       ///< Unknown function, possibly differentiated
+                Concrete,       ///< Replaced by a value
+                Null            ///< Differentiated by a variable it does not depend on
+            };
+
+            /// @return Index of the argument named like `var`, or the number of arguments
+            size_t argument(const Variable &var) const
+            {
+                for (size_t i = 0; i < sizeof...(Args); ++i)
+                {
+                    if (args[i] == var.internedName()) return i;
+                }
+
+                return sizeof...(Args);
+            }
+
+            /// Unique name of this function
+            const std::string *name;
+
+            /// Names of the arguments
+            std::array<const std::string*, sizeof...(Args)> args;
+
+            /// Derivative order with respect to each argument
+            std::array<size_t, sizeof...(Args)> d = { };
+
+            State state = State::Abstract;
+            double _value = 0;
     };
 }
 
@@ -0,0 +1,163 @@
+#ifndef _BZHIGHORDER_HH_
+#define _BZHIGHORDER_HH_
+
+#include "bzexpression.hh"
+#include "bzfunction.hh"
+
+#include <array>
+#include <utility>
+
+namespace benzaiten
+{
+    constexpr size_t factorial(size_t n)
+    {
+        return (n < 2) ? 1 : n * factorial(n - 1);
+    }
+
+    constexpr size_t binomial(size_t n, size_t k)
+    {
+        return factorial(n) / (factorial(k) * factorial(n - k));
+    }
+
+    constexpr size_t integerPower(size_t base, size_t exponent)
+    {
+        return (exponent == 0) ? 1 : base * integerPower(base, exponent - 1);
+    }
+
+    /// @return `e * C`, leaving the expression alone when `C` is one
+    template <size_t C, typename E>
+    auto scale(const E &e)
+    {
+        if constexpr (C == 1) return e;
+        else return e * static_cast<double>(C);
+    }
+
+    /// @return `e` multiplied by itself `M` times, or One if `M` is zero
+    template <size_t M, typename E>
+    auto repeat(const E &e)
+    {
+        if constexpr (M == 0) return One();
+        else if constexpr (M == 1) return e;
+        else return e * repeat<M - 1>(e);
+    }
+
+    /// @return `(d^J f)^M`, without differentiating at all when `M` is zero
+    template <size_t M, size_t J, typename F, typename V>
+    auto derivativePower(const F &fn, const V &var)
+    {
+        if constexpr (M == 0) return One();
+        else return repeat<M>(fn.template derivative<J>(var));
+    }
+
+    template <size_t N, typename E1, typename E2, typename V, size_t... Ks>
+    auto leibniz(const E1 &fn1, const E2 &fn2, const V &var, std::index_sequence<Ks...>)
+    {
+        return (scale<binomial(N, Ks)>(fn1.template derivative<N - Ks>(var) *
+            fn2.template derivative<Ks>(var)) + ...);
+    }
+
+    /**
+     * The Leibniz rule, `d^N (f g) = sum C(N, k) f^(N-k) g^(k)`, which
+     * needs only N + 1 terms where repeated application of the product rule
+     * produces 2^N.
+     */
+    template <size_t N, typename E1, typename E2, typename V>
+    auto leibniz(const E1 &fn1, const E2 &fn2, const V &var)
+    {
+        return leibniz<N>(fn1, fn2, var, std::make_index_sequence<N + 1>());
+    }
+
+    constexpr size_t partitionCount(size_t n, size_t largest)
+    {
+        if (n == 0) return 1;
+
+        size_t count = 0;
+        for (size_t k = 1; (k <= largest) && (k <= n); ++k) count += partitionCount(n - k, k);
+
+        return count;
+    }
+
+    /**
+     * Every partition of `N`, with `table[p][j]` the number of parts of
+     * size `j` in the partition `p`.
+     */
+    template <size_t N>
+    struct Partitions
+    {
+        static constexpr size_t count = partitionCount(N, N);
+
+        using Table = std::array<std::array<size_t, N + 1>, count>;
+
+        static constexpr Table build()
+        {
+            Table table { };
+            std::array<size_t, N + 1> parts { };
+
+            // parts in decreasing order, from { N } down to { 1, ..., 1 }
+            size_t size = 1, p = 0;
+            parts[0] = N;
+
+            while (true)
+            {
+                for (size_t i = 0; i < size; ++i) ++table[p][parts[i]];
+                ++p;
+
+                size_t rest = 0;
+                while ((size > 0) && (parts[size - 1] == 1)) { ++rest; --size; }
+
+                if (size == 0) break;
+
+                size_t k = --parts[size - 1];
+                ++rest;
+
+                while (rest > k)
+                {
+                    parts[size++] = k;
+                    rest -= k;
+                }
+
+                parts[size++] = rest;
+            }
+
+            return table;
+        }
+
+        static constexpr Table table = build();
+    };
+
+    template <size_t N, size_t P, typename H, typename F, typename V, size_t... Js>
+    auto faaDiBrunoTerm(const H &outer, const F &fn, const V &var, std::index_sequence<Js...>)
+    {
+        constexpr const std::array<size_t, N + 1> &m = Partitions<N>::table[P];
+        constexpr size_t k = (m[Js + 1] + ...);
+        constexpr size_t denom = ((factorial(m[Js + 1]) *
+            integerPower(factorial(Js + 1), m[Js + 1])) * ...);
+
+        return scale<factorial(N) / denom>(outer.template outerDerivative<k>() *
+            (derivativePower<m[Js + 1], Js + 1>(fn, var) * ...));
+    }
+
+    template <size_t N, typename H, typename F, typename V, size_t... Ps>
+    auto faaDiBruno(const H &outer, const F &fn, const V &var, std::index_sequence<Ps...>)
+    {
+        return (faaDiBrunoTerm<N, Ps>(outer, fn, var, std::make_index_sequence<N>()) + ...);
+    }
+
+    /**
+     * Faà di Bruno's formula for `d^N h(f)`: one term per partition of N,
+     *
+     *     N! / prod(m_j! j!^m_j) h^(k)(f) prod (f^(j))^m_j,
+     *
+     * where `m_j` parts of the partition have size j and k = sum m_j. The
+     * composition `outer` supplies `h^(k)(f)` as `outerDerivative<k>()`.
+     */
+    template <size_t N, typename H, typename F, typename V>
+    auto faaDiBruno(const H &outer, const F &fn, const V &var)
+    {
+        return faaDiBruno<N>(outer, fn, var, std::make_index_sequence<Partitions<N>::count>());
+    }
+}
+
+#endif      // _BZHIGHORDER_HH_
+
+// vim: set ft=cpp.doxygen:
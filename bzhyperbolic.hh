@@ -3,8 +3,10 @@
 
 #include "bzvariable.hh"
 #include "bzfunction.hh"
+#include "bzhighorder.hh"
 
 #include <cmath>
+#include <cfloat>
 
 double coth(double x)
 {
@@ -50,99 +52,25 @@ namespace benzaiten
     template <typename E>
     struct FunctionCsch;
 
-    template <typename F, size_t Order>
-    struct SinhDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionCosh<F>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct SinhDerivativeType<F, 0>
-    {
-        using type = FunctionSinh<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct CoshDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionSinh<F>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct CoshDerivativeType<F, 0>
-    {
-        using type = FunctionCosh<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct TanhDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionProduct<FunctionSech<F>, FunctionSech<F>>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct TanhDerivativeType<F, 0>
-    {
-        using type = FunctionTanh<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct CothDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionCsch<F>>, FunctionCsch<F>>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct CothDerivativeType<F, 0>
-    {
-        using type = FunctionCoth<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct SechDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionTanh<F>>, FunctionSech<F>>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct SechDerivativeType<F, 0>
-    {
-        using type = FunctionSech<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct CschDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionCoth<F>>, FunctionCsch<F>>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct CschDerivativeType<F, 0>
-    {
-        using type = FunctionCsch<F>;
-    };
-
     template <typename E>
     struct FunctionSinh : public FunctionExpression<FunctionSinh<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionCosh<E>,
-                typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionSinh(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename SinhDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return (cosh(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
+                else return faaDiBruno<Order>(*this, fn, var);
+            }
+
+            /// @return `d^K sinh(u) / du^K` at `u = fn`
+            template <size_t K>
+            auto outerDerivative() const
+            {
+                if constexpr (K % 2 == 0) return *this;
+                else return cosh(fn);
             }
 
             FunctionSinh<E>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -163,6 +91,17 @@ namespace benzaiten
                 return FunctionSinh<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::sinh;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return sinh(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -192,17 +131,21 @@ namespace benzaiten
     struct FunctionCosh : public FunctionExpression<FunctionCosh<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionSinh<E>,
-                typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionCosh(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename CoshDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return (sinh(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
+                else return faaDiBruno<Order>(*this, fn, var);
+            }
+
+            /// @return `d^K cosh(u) / du^K` at `u = fn`
+            template <size_t K>
+            auto outerDerivative() const
+            {
+                if constexpr (K % 2 == 0) return *this;
+                else return sinh(fn);
             }
 
             FunctionCosh<E>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -212,7 +155,7 @@ namespace benzaiten
                 if (fn.isConcrete())
                 {
                     _isConcrete = true;
-                    _value = sinh(fn.getValue());
+                    _value = cosh(fn.getValue());
                 }
 
                 return *this;
@@ -223,6 +166,17 @@ namespace benzaiten
                 return FunctionCosh<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::cosh;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return cosh(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -252,14 +206,10 @@ namespace benzaiten
     struct FunctionTanh : public FunctionExpression<FunctionTanh<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionProduct<FunctionSech<E>, FunctionSech<E>>,
-                typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionTanh(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename TanhDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return (sech(fn) * sech(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
@@ -283,6 +233,17 @@ namespace benzaiten
                 return FunctionTanh<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::tanh;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return tanh(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -312,15 +273,10 @@ namespace benzaiten
     struct FunctionCoth : public FunctionExpression<FunctionCoth<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type =
-                typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionCsch<E>>, FunctionCsch<E>>,
-                    typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionCoth(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename CothDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return (-csch(fn) * csch(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
@@ -344,6 +300,17 @@ namespace benzaiten
                 return FunctionCoth<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using ::coth;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return coth(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -373,15 +340,10 @@ namespace benzaiten
     struct FunctionSech : public FunctionExpression<FunctionSech<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type =
-                typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionTanh<E>>, FunctionSech<E>>,
-                    typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionSech(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename SechDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return (-tanh(fn) * sech(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
@@ -405,6 +367,17 @@ namespace benzaiten
                 return FunctionSech<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using ::sech;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return sech(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -434,15 +407,10 @@ namespace benzaiten
     struct FunctionCsch : public FunctionExpression<FunctionCsch<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type =
-                typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionCoth<E>>, FunctionCsch<E>>,
-                    typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionCsch(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename CschDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return (-coth(fn) * csch(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
@@ -466,6 +434,17 @@ namespace benzaiten
                 return FunctionCsch<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using ::csch;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return csch(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -0,0 +1,317 @@
+#ifndef _BZJACOBIAN_HH_
+#define _BZJACOBIAN_HH_
+
+#include "bzbind.hh"
+#include "bzbatch.hh"
+#include "bztape.hh"
+#include "bzparallel.hh"
+#include "bzstencil.hh"
+
+#include <cstddef>
+#include <algorithm>
+
+namespace benzaiten
+{
+    /// A sparse matrix in compressed sparse row form
+    struct SparseMatrix
+    {
+        size_t rows = 0, cols = 0;
+
+        /// Entries of row `r` are `rowStart[r]` up to `rowStart[r + 1]`
+        std::vector<size_t> rowStart;
+        std::vector<size_t> column;
+        std::vector<double> values;
+
+        size_t nonzeros() const { return column.size(); }
+    };
+
+    /**
+     * Jacobian of a system of residuals on a grid with respect to the grid
+     * values of its unknown functions, for Newton iterations.
+     *
+     * Each residual is compiled against a shared schema. The derivatives of
+     * an unknown that the residuals read are approximated by stencils, so
+     * the residual at one point depends on the unknown at a few neighbouring
+     * points; the tape of each residual tells which slots it reads, which
+     * gives the exact sparsity pattern. The pattern is computed once, and
+     * `assemble` then fills the values from the reverse-mode gradient of
+     * every residual, chained through the stencil weights.
+     *
+     * Rows and columns interleave the equations and unknowns of each point:
+     * row `i * numEquations() + e` is equation `e` at point `i`, and column
+     * `j * numUnknowns() + u` is unknown `u` at point `j`. The rows of one
+     * point are therefore consecutive, as block solvers expect. Neighbours
+     * outside the grid are dropped, so boundary rows are normally replaced
+     * by the caller's boundary conditions.
+     *
+     * Given only a number of points, the grid is one-dimensional. Given a
+     * Grid, stencil offsets are flattened with its strides, as by
+     * `Stencil::strided`, and neighbours are dropped axis by axis, so a
+     * stencil does not wrap from the end of one row to the next; the step
+     * along each axis must then be less than half its size.
+     */
+    struct SparseJacobian
+    {
+        SparseJacobian(const Schema &schema, size_t points) : schema(schema), points(points) { }
+
+        SparseJacobian(const Schema &schema, const Grid &grid) :
+            schema(schema), grid(grid), points(grid.points()) { }
+
+        /// Add an unknown function; its own value enters with weight one
+        SparseJacobian& unknown(const std::string &name)
+        {
+            unknowns.push_back(name);
+            return stencil(name, { }, Stencil({ 0 }, { 1 }));
+        }
+
+        /// Approximate a derivative of a function added by `unknown` by a stencil
+        SparseJacobian& stencil(const std::string &name,
+            const std::unordered_map<std::string, size_t> &d, const Stencil &st)
+        {
+            auto it = std::find(unknowns.begin(), unknowns.end(), name);
+            if (it == unknowns.end()) return *this;
+
+            size_t slot = schema.add(name, d);
+            if (slot >= stencils.size()) stencils.resize(slot + 1);
+
+            stencils[slot] = { static_cast<size_t>(it - unknowns.begin()), st };
+            built = false;
+
+            return *this;
+        }
+
+        /// Add a residual equation; every leaf it reads is given a slot
+        template <typename E>
+        SparseJacobian& equation(FunctionExpression<E> const& residual)
+        {
+            SlotAllocator allocator(schema);
+            static_cast<E const&>(residual).evaluate(allocator);
+
+            tapes.push_back(compile(residual, schema));
+            built = false;
+
+            return *this;
+        }
+
+        size_t numUnknowns() const { return unknowns.size(); }
+
+        size_t numEquations() const { return tapes.size(); }
+
+        const Schema& getSchema() const { return schema; }
+
+        /// @return The sparsity pattern, with all values zero
+        const SparseMatrix& pattern()
+        {
+            if (!built) build();
+            return matrix;
+        }
+
+        /**
+         * Fill the Jacobian at the state given by the fields of `layout`,
+         * which must be laid out by `getSchema()` and provide every slot the
+         * residuals read, derivatives included. If `residual` is given, the
+         * residuals are written to it in row order.
+         */
+        const SparseMatrix& assemble(const FieldLayout &layout, double *residual = nullptr)
+        {
+            if (!built) build();
+
+            Workspace ws(*this);
+            assemble(layout, residual, 0, points, ws);
+
+            return matrix;
+        }
+
+        /// Fill the Jacobian on a thread pool; each row is written by one worker
+        const SparseMatrix& assemble(const FieldLayout &layout, ThreadPool &pool,
+            double *residual = nullptr, size_t tile = 0)
+        {
+            if (!built) build();
+            if (tile == 0) tile = tileSize(schema.size());
+
+            std::vector<Workspace> ws(pool.size(), Workspace(*this));
+
+            pool.parallelFor((points + tile - 1) / tile, [&](size_t t, size_t worker)
+            {
+                assemble(layout, residual, t * tile, std::min(points, (t + 1) * tile), ws[worker]);
+            });
+
+            return matrix;
+        }
+
+        private:
+            /// Sensitivity of an entry to one slot of one residual
+            struct Scatter
+            {
+                size_t slot;
+                double weight;
+                size_t position;
+            };
+
+            struct Workspace
+            {
+                Workspace(const SparseJacobian &jac) : in(jac.schema.size()),
+                    grad(jac.schema.size())
+                {
+                    size_t size = 0;
+                    for (const Tape &tape : jac.tapes) size = std::max(size, tape.gradientWorkspace().size());
+                    w.resize(size);
+                }
+
+                std::vector<double> in, grad, w;
+            };
+
+            void build()
+            {
+                const size_t neq = tapes.size();
+
+                // slots read by each residual that depend on an unknown
+                std::vector<std::vector<size_t>> reads(neq);
+
+                for (size_t e = 0; e < neq; ++e)
+                {
+                    for (const TapeInstruction &ins : tapes[e].instructions())
+                    {
+                        if ((ins.op == TapeOp::Load) && (ins.a < stencils.size()) &&
+                            (!stencils[ins.a].second.offsets.empty()))
+                        {
+                            reads[e].push_back(ins.a);
+                        }
+                    }
+                }
+
+                matrix = SparseMatrix();
+                matrix.rows = points * neq;
+                matrix.cols = points * unknowns.size();
+                matrix.rowStart.push_back(0);
+
+                scatter.clear();
+                scatterStart.assign(1, 0);
+
+                std::vector<size_t> cols;
+
+                for (size_t i = 0; i < points; ++i)
+                {
+                    for (size_t e = 0; e < neq; ++e)
+                    {
+                        cols.clear();
+                        forEachNeighbour(i, reads[e], [&](size_t, double, size_t col)
+                        {
+                            cols.push_back(col);
+                        });
+
+                        std::sort(cols.begin(), cols.end());
+                        cols.erase(std::unique(cols.begin(), cols.end()), cols.end());
+
+                        size_t start = matrix.column.size();
+                        matrix.column.insert(matrix.column.end(), cols.begin(), cols.end());
+                        matrix.rowStart.push_back(matrix.column.size());
+
+                        forEachNeighbour(i, reads[e], [&](size_t slot, double weight, size_t col)
+                        {
+                            size_t pos = std::lower_bound(cols.begin(), cols.end(), col) - cols.begin();
+                            scatter.push_back({ slot, weight, start + pos });
+                        });
+
+                        scatterStart.push_back(scatter.size());
+                    }
+                }
+
+                matrix.values.assign(matrix.column.size(), 0);
+                built = true;
+            }
+
+            /// Call `fn(slot, weight, column)` for every in-grid stencil point
+            template <typename F>
+            void forEachNeighbour(size_t i, const std::vector<size_t> &slots, F &&fn) const
+            {
+                const size_t nunk = unknowns.size();
+
+                for (size_t slot : slots)
+                {
+                    const Stencil &st = stencils[slot].second;
+
+                    for (size_t k = 0; k < st.offsets.size(); ++k)
+                    {
+                        std::ptrdiff_t j = static_cast<std::ptrdiff_t>(i) + st.offsets[k];
+
+                        if ((j < 0) || (j >= static_cast<std::ptrdiff_t>(points))) continue;
+                        if ((grid.numAxes() > 1) && !onGrid(i, st.offsets[k])) continue;
+
+                        fn(slot, st.weights[k], j * nunk + stencils[slot].first);
+                    }
+                }
+            }
+
+            /// @return Whether point `i` moved by a flattened offset stays on every axis
+            bool onGrid(size_t i, std::ptrdiff_t offset) const
+            {
+                for (size_t a = grid.numAxes(); a-- > 0; )
+                {
+                    const std::ptrdiff_t stride = grid.stride(a);
+                    const std::ptrdiff_t size = grid.size(a);
+
+                    // the nearest multiple of the stride, since steps along faster axes are shorter
+                    std::ptrdiff_t step = (offset >= 0) ? (offset + stride / 2) / stride :
+                        -((stride / 2 - offset) / stride);
+                    offset -= step * stride;
+
+                    std::ptrdiff_t c = static_cast<std::ptrdiff_t>(i) / stride % size + step;
+                    if ((c < 0) || (c >= size)) return false;
+                }
+
+                return true;
+            }
+
+            void assemble(const FieldLayout &layout, double *residual,
+                size_t begin, size_t end, Workspace &ws)
+            {
+                const size_t neq = tapes.size();
+
+                for (size_t i = begin; i < end; ++i)
+                {
+                    // slots added after the layout was built have no field
+                    for (size_t s = 0; s < ws.in.size(); ++s)
+                    {
+                        const double *field = (s < layout.numFields()) ? layout.field(s) : nullptr;
+
+                        ws.in[s] = (field == nullptr) ? std::numeric_limits<double>::quiet_NaN() :
+                            field[i * layout.stride(s)];
+                    }
+
+                    for (size_t e = 0; e < neq; ++e)
+                    {
+                        size_t row = i * neq + e;
+                        double value = tapes[e].gradient(ws.in.data(), ws.grad.data(), ws.w.data());
+
+                        if (residual != nullptr) residual[row] = value;
+
+                        double *values = matrix.values.data();
+                        for (size_t p = matrix.rowStart[row]; p < matrix.rowStart[row + 1]; ++p) values[p] = 0;
+
+                        for (size_t k = scatterStart[row]; k < scatterStart[row + 1]; ++k)
+                        {
+                            values[scatter[k].position] += ws.grad[scatter[k].slot] * scatter[k].weight;
+                        }
+                    }
+                }
+            }
+
+            Schema schema;
+            Grid grid;
+            size_t points;
+
+            std::vector<std::string> unknowns;
+            std::vector<std::pair<size_t, Stencil>> stencils;
+            std::vector<Tape> tapes;
+
+            bool built = false;
+            SparseMatrix matrix;
+            std::vector<Scatter> scatter;
+            std::vector<size_t> scatterStart;
+    };
+}
+
+#endif      // _BZJACOBIAN_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,312 @@
+#ifndef _BZJIT_HH_
+#define _BZJIT_HH_
+
+#include "bzbind.hh"
+#include "bzbatch.hh"
+#include "bztape.hh"
+#include "bzcodegen.hh"
+
+#include <atomic>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <dlfcn.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#define BZ_HAVE_DLOPEN 1
+
+extern char **environ;
+#endif
+
+namespace benzaiten
+{
+    /// How `jit` builds and caches native kernels
+    struct JitOptions
+    {
+        JitOptions()
+        {
+            const char *cc = std::getenv("CC");
+            if (cc != nullptr) compiler = cc;
+
+            const char *dir = std::getenv("BENZAITEN_CACHE");
+            const char *xdg = std::getenv("XDG_CACHE_HOME");
+            const char *home = std::getenv("HOME");
+
+            if (dir != nullptr) cacheDirectory = dir;
+            else if (xdg != nullptr) cacheDirectory = std::string(xdg) + "/benzaiten";
+            else if (home != nullptr) cacheDirectory = std::string(home) + "/.cache/benzaiten";
+        }
+
+        /// Compiler and flags, split at spaces into the arguments of the compiler
+        std::string compiler = "cc";
+        std::string flags = "-O3 -std=c99 -fPIC -shared";
+
+        /**
+         * Where kernels are built and cached; it is created private to the
+         * user, and used only if it is owned by the user and writable by no
+         * one else. Without one, kernels are not compiled.
+         */
+        std::string cacheDirectory;
+    };
+
+    /// @return 64-bit FNV-1a hash, which is stable between runs and builds
+    inline uint64_t stableHash(const std::string &text)
+    {
+        uint64_t h = 14695981039346656037ull;
+
+        for (char c : text)
+        {
+            h ^= static_cast<unsigned char>(c);
+            h *= 1099511628211ull;
+        }
+
+        return h;
+    }
+
+#ifdef BZ_HAVE_DLOPEN
+    /// Create a directory and its parents, readable by the user only
+    inline void makeDirectories(const std::string &path)
+    {
+        for (size_t i = 1; i <= path.size(); ++i)
+        {
+            if ((i == path.size()) || (path[i] == '/')) mkdir(path.substr(0, i).c_str(), 0700);
+        }
+    }
+
+    /**
+     * @return Whether a file exists, is owned by the effective user and
+     * cannot be written by anyone else, so that no other user could have
+     * put a library in it or in its place
+     */
+    inline bool isPrivate(const std::string &path)
+    {
+        struct stat st;
+
+        return (stat(path.c_str(), &st) == 0) && (st.st_uid == geteuid()) &&
+            ((st.st_mode & (S_IWGRP | S_IWOTH)) == 0);
+    }
+
+    /**
+     * Run a command without a shell, with its output and errors written to
+     * the file `log`; @return Whether it ran and exited successfully
+     */
+    inline bool runCommand(const std::vector<std::string> &args, const std::string &log)
+    {
+        std::vector<char*> argv;
+        for (const std::string &arg : args) argv.push_back(const_cast<char*>(arg.c_str()));
+        argv.push_back(nullptr);
+
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, log.c_str(),
+            O_WRONLY | O_CREAT | O_TRUNC, 0600);
+        posix_spawn_file_actions_adddup2(&actions, STDOUT_FILENO, STDERR_FILENO);
+
+        pid_t pid;
+        int status = 0;
+        bool ok = (posix_spawnp(&pid, argv[0], &actions, nullptr, argv.data(), environ) == 0) &&
+            (waitpid(pid, &status, 0) == pid) && WIFEXITED(status) && (WEXITSTATUS(status) == 0);
+
+        posix_spawn_file_actions_destroy(&actions);
+        return ok;
+    }
+#endif
+
+    /// @return The words of a command line, split at whitespace
+    inline std::vector<std::string> splitCommand(const std::string &command)
+    {
+        std::istringstream ss(command);
+        std::vector<std::string> words;
+
+        for (std::string word; ss >> word; ) words.push_back(word);
+        return words;
+    }
+
+    /**
+     * An expression compiled to native code by the system C compiler and
+     * loaded as a shared object, with the template evaluation as a fallback
+     * when no compiler or dynamic loader is available. The kernel is
+     * immutable and may be called concurrently.
+     */
+    template <typename E>
+    struct JitKernel
+    {
+        using Entry = void (*)(size_t, const double *const *, double *);
+
+        /**
+         * Compile an expression into a native kernel. The C source from
+         * `generateC` and an entry point taking the argument arrays as a
+         * list are hashed together with the compiler command; a shared
+         * object with that hash in the cache directory is loaded directly,
+         * so later runs with the same equations do not compile at all. If
+         * compiling or loading fails, the kernel evaluates the bound
+         * expression instead, and `error` tells why.
+         */
+        JitKernel(const E &expr, const Schema &schema, const JitOptions &options) :
+            plan(expr, schema)
+        {
+            Tape tape = compile(expr, schema);
+            slots = kernelArguments(tape);
+
+#ifdef BZ_HAVE_DLOPEN
+            std::ostringstream src;
+            src << generateC(tape, schema, "bz_kernel") << std::endl;
+            src << "void bz_entry(size_t n, const double *const *in, double *out)" << std::endl;
+            src << "{" << std::endl << "    bz_kernel(n";
+            for (size_t k = 0; k < slots.size(); ++k) src << ", in[" << k << "]";
+            src << ", out);" << std::endl << "}" << std::endl;
+
+            std::string command = options.compiler + " " + options.flags;
+
+            std::ostringstream name;
+            name << "bz_" << std::hex << std::setw(16) << std::setfill('0')
+                << stableHash(command + "\n" + src.str());
+
+            std::string base = options.cacheDirectory + "/" + name.str();
+            path = base + ".so";
+
+            if (!options.cacheDirectory.empty()) makeDirectories(options.cacheDirectory);
+
+            if (options.cacheDirectory.empty() || !isPrivate(options.cacheDirectory))
+            {
+                message = "no private cache directory: \"" + options.cacheDirectory + "\"";
+            }
+            else if (access(path.c_str(), F_OK) == 0) cached = true;
+            else
+            {
+                // build under a name unique to this call, then rename so
+                // that readers never see a partial library
+                static std::atomic<uint64_t> builds(0);
+                std::string tmp = base + "." + std::to_string(getpid()) + "." + std::to_string(builds++);
+                std::ofstream(tmp + ".c") << src.str();
+
+                std::vector<std::string> args = splitCommand(command);
+                args.insert(args.end(), { "-o", tmp + ".so", tmp + ".c", "-lm" });
+
+                bool built = !args.empty() && runCommand(args, tmp + ".log");
+
+                if (!built)
+                {
+                    std::ifstream log(tmp + ".log");
+                    std::ostringstream ss;
+                    ss << log.rdbuf();
+                    message = "compiling failed: " + command + "\n" + ss.str();
+                }
+
+                if (!built || (std::rename((tmp + ".so").c_str(), path.c_str()) != 0))
+                {
+                    std::remove((tmp + ".so").c_str());
+                }
+
+                std::remove((tmp + ".log").c_str());
+                std::rename((tmp + ".c").c_str(), (base + ".c").c_str());
+            }
+
+            if (message.empty() && !isPrivate(path))
+            {
+                message = "not loading " + path + ", which another user could have written";
+            }
+            else if (message.empty())
+            {
+                void *lib = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+
+                if (lib != nullptr)
+                {
+                    handle = std::shared_ptr<void>(lib, [](void *h) { dlclose(h); });
+                    entry = reinterpret_cast<Entry>(dlsym(lib, "bz_entry"));
+                }
+
+                const char *why = (entry == nullptr) ? dlerror() : nullptr;
+                if (entry == nullptr) message = (why != nullptr) ? why : "no entry point in " + path;
+            }
+
+            if (entry == nullptr)
+            {
+                cached = false;
+                path.clear();
+            }
+#else
+            message = "native kernels need a dynamic loader";
+#endif
+        }
+
+        /// @return Whether a native kernel is loaded; otherwise the plan is used
+        bool isNative() const { return entry != nullptr; }
+
+        /// @return Whether the native kernel came from the cache without compiling
+        bool fromCache() const { return cached; }
+
+        /// @return Path of the shared object, or empty if there is none
+        const std::string& library() const { return path; }
+
+        /// @return Why there is no native kernel, such as the compiler's errors
+        const std::string& error() const { return message; }
+
+        /**
+         * Evaluate at `n` points, writing `out[i]` for each. Fields with a
+         * stride other than one, including broadcast fields, are copied
+         * into contiguous scratch arrays first.
+         */
+        void evaluate(const FieldLayout &layout, double *out, size_t n) const
+        {
+            if (!isNative())
+            {
+                benzaiten::evaluate(plan, layout, out, n);
+                return;
+            }
+
+            std::vector<const double*> args(slots.size());
+            std::vector<std::vector<double>> scratch;
+            scratch.reserve(slots.size());
+
+            for (size_t k = 0; k < slots.size(); ++k)
+            {
+                const double *field = layout.field(slots[k]);
+                size_t stride = layout.stride(slots[k]);
+
+                if ((field != nullptr) && (stride == 1))
+                {
+                    args[k] = field;
+                    continue;
+                }
+
+                scratch.emplace_back(n, std::numeric_limits<double>::quiet_NaN());
+                if (field != nullptr) for (size_t i = 0; i < n; ++i) scratch.back()[i] = field[i * stride];
+
+                args[k] = scratch.back().data();
+            }
+
+            entry(n, args.data(), out);
+        }
+
+        private:
+            Plan<E> plan;
+            std::vector<size_t> slots;
+
+            std::shared_ptr<void> handle;
+            Entry entry = nullptr;
+            bool cached = false;
+            std::string path;
+            std::string message;
+    };
+
+    template <typename E>
+    JitKernel<E> jit(FunctionExpression<E> const& expr, const Schema &schema,
+        const JitOptions &options = JitOptions())
+    {
+        return JitKernel<E>(static_cast<E const&>(expr), schema, options);
+    }
+}
+
+#endif      // _BZJIT_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,201 @@
+#ifndef _BZLEAVES_HH_
+#define _BZLEAVES_HH_
+
+#include "bzexpression.hh"
+#include "bzvariable.hh"
+#include "bzfunction.hh"
+#include "bzpower.hh"
+#include "bzstatic.hh"
+#include "bzbind.hh"
+#include "bzbatch.hh"
+
+#include <type_traits>
+
+namespace benzaiten
+{
+    /// A set of leaf types, each listed once, in the order they are first reached
+    template <typename... Ls>
+    struct LeafList
+    {
+        static constexpr size_t size = sizeof...(Ls);
+
+        template <typename L>
+        static constexpr bool contains()
+        {
+            return (std::is_same<L, Ls>::value || ...);
+        }
+    };
+
+    template <typename List, typename L>
+    struct LeafInsert;
+
+    template <typename... As, typename L>
+    struct LeafInsert<LeafList<As...>, L>
+    {
+        using type = typename std::conditional<LeafList<As...>::template contains<L>(),
+            LeafList<As...>, LeafList<As..., L>>::type;
+    };
+
+    template <typename List, typename Other>
+    struct LeafUnion;
+
+    template <typename List>
+    struct LeafUnion<List, LeafList<>>
+    {
+        using type = List;
+    };
+
+    template <typename List, typename L, typename... Ls>
+    struct LeafUnion<List, LeafList<L, Ls...>>
+    {
+        using type = typename LeafUnion<typename LeafInsert<List, L>::type, LeafList<Ls...>>::type;
+    };
+
+    /**
+     * The leaf types of an expression type, found without evaluating it.
+     * A node is any template over its child expressions; variables,
+     * functions and their static counterparts are leaves; constants have
+     * no leaves.
+     */
+    template <typename E>
+    struct Leaves;
+
+    template <typename List, typename... Es>
+    struct LeavesOfAll
+    {
+        using type = List;
+    };
+
+    template <typename List, typename E, typename... Es>
+    struct LeavesOfAll<List, E, Es...>
+    {
+        using type = typename LeavesOfAll<typename LeafUnion<List,
+            typename Leaves<E>::type>::type, Es...>::type;
+    };
+
+    template <template <typename...> class N, typename... Cs>
+    struct Leaves<N<Cs...>> : public LeavesOfAll<LeafList<>, Cs...> { };
+
+    template <typename E, int N>
+    struct Leaves<FunctionIntegerPower<E, N>> : public LeavesOfAll<LeafList<>, E> { };
+
+    template <>
+    struct Leaves<Constant> { using type = LeafList<>; };
+
+    template <>
+    struct Leaves<Zero> { using type = LeafList<>; };
+
+    template <>
+    struct Leaves<One> { using type = LeafList<>; };
+
+    template <>
+    struct Leaves<Variable> { using type = LeafList<Variable>; };
+
+    template <typename... Args>
+    struct Leaves<Function<Args...>> { using type = LeafList<Function<Args...>>; };
+
+    template <typename Tag>
+    struct Leaves<StaticVariable<Tag>> { using type = LeafList<StaticVariable<Tag>>; };
+
+    template <typename Tag, typename Orders, typename... Vars>
+    struct Leaves<StaticDerivative<Tag, Orders, Vars...>>
+    {
+        using type = LeafList<StaticDerivative<Tag, Orders, Vars...>>;
+    };
+
+    template <typename E>
+    using LeavesOf = typename Leaves<E>::type;
+
+    /**
+     * Whether a leaf type alone identifies the value it needs. Static
+     * variables and static function derivatives carry their name and
+     * derivative orders in the type; runtime leaves only know theirs once
+     * constructed.
+     */
+    template <typename L>
+    struct IsStaticLeaf : public std::false_type { };
+
+    template <typename Tag>
+    struct IsStaticLeaf<StaticVariable<Tag>> : public std::true_type { };
+
+    template <typename Tag, typename Orders, typename... Vars>
+    struct IsStaticLeaf<StaticDerivative<Tag, Orders, Vars...>> : public std::true_type { };
+
+    template <typename List, typename... Provided>
+    struct LeavesProvided;
+
+    template <typename... Ls, typename... Provided>
+    struct LeavesProvided<LeafList<Ls...>, Provided...> : public std::integral_constant<bool,
+        (LeafList<Provided...>::template contains<Ls>() && ...)> { };
+
+    /**
+     * @return Whether every leaf of `E` is one of the `Provided` leaf
+     * types, for example in a static_assert before binding an expression of
+     * static variables and functions
+     */
+    template <typename E, typename... Provided>
+    constexpr bool isBoundBy()
+    {
+        return LeavesProvided<LeavesOf<E>, Provided...>::value;
+    }
+
+    /// @return Keys of the leaves of a fully static expression type, known without an instance
+    template <typename... Ls>
+    std::vector<std::string> staticKeys(LeafList<Ls...>)
+    {
+        static_assert((IsStaticLeaf<Ls>::value && ...),
+            "only static leaves are identified by their type");
+
+        return { Ls().key()... };
+    }
+
+    /**
+     * @return A schema with one slot for every variable and function
+     * derivative the expression reads, in evaluation order, so that only
+     * the fields actually needed are allocated
+     */
+    template <typename E>
+    Schema requiredInputs(FunctionExpression<E> const& expr)
+    {
+        Schema schema;
+        SlotAllocator allocator(schema);
+
+        static_cast<E const&>(expr).evaluate(allocator);
+        return schema;
+    }
+
+    /// @return Keys of the inputs of an expression that have no slot in a schema
+    template <typename E>
+    std::vector<std::string> missingInputs(FunctionExpression<E> const& expr, const Schema &schema)
+    {
+        Schema required = requiredInputs(expr);
+        std::vector<std::string> missing;
+
+        for (size_t k = 0; k < required.size(); ++k)
+        {
+            if (schema.findKey(required.key(k)) == Schema::npos) missing.push_back(required.key(k));
+        }
+
+        return missing;
+    }
+
+    /// @return Keys of the inputs of an expression that have no field in a layout
+    template <typename E>
+    std::vector<std::string> missingInputs(FunctionExpression<E> const& expr, const FieldLayout &layout)
+    {
+        Schema required = requiredInputs(expr);
+        std::vector<std::string> missing;
+
+        for (size_t k = 0; k < required.size(); ++k)
+        {
+            size_t slot = layout.getSchema().findKey(required.key(k));
+            if ((slot == Schema::npos) || (layout.field(slot) == nullptr)) missing.push_back(required.key(k));
+        }
+
+        return missing;
+    }
+}
+
+#endif      // _BZLEAVES_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -12,32 +12,28 @@ namespace benzaiten
     template <typename E>
     struct FunctionLog;
 
-    template <typename F, size_t Order>
-    struct LogDerivativeType
-    {
-        using type = typename QuotientDerivativeType<typename F::template deriv_type<1>, F, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct LogDerivativeType<F, 0>
-    {
-        using type = FunctionLog<F>;
-    };
-
     template <typename E>
     struct FunctionLog : public FunctionExpression<FunctionLog<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename QuotientDerivativeType<typename E::template deriv_type<1>, E, Order - 1>::type;
-
             FunctionLog(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename LogDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return (fn.template derivative<1>(var) / fn).template derivative<Order-1>(var);
+                else if constexpr (Order == 1) return fn.template derivative<1>(var) / fn;
+                else return faaDiBruno<Order>(*this, fn, var);
+            }
+
+            /// @return `d^K log(u) / du^K = (-1)^(K-1) (K-1)! / u^K` at `u = fn`
+            template <size_t K>
+            auto outerDerivative() const
+            {
+                if constexpr (K == 0) return *this;
+                else if constexpr (K == 1) return 1.0 / fn;
+                else return pow(fn, -static_cast<double>(K)) *
+                    (((K % 2) ? 1.0 : -1.0) * factorial(K - 1));
             }
 
             FunctionLog<E>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -58,6 +54,17 @@ namespace benzaiten
                 return FunctionLog<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::log;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return log(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -13,14 +13,10 @@ namespace benzaiten
     struct FunctionNegate : public FunctionExpression<FunctionNegate<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = FunctionNegate<typename E::template deriv_type<Order>>;
-
             FunctionNegate(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            FunctionNegate<typename E::template deriv_type<Order>>
-                derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return -(fn.template derivative<Order>(var));
@@ -44,10 +40,21 @@ namespace benzaiten
                 return FunctionNegate<E>(*this).substitute(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return -v;
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
 
+            const E& getOperand() const { return fn; }
+
             friend std::ostream& operator<<(std::ostream &os, const FunctionNegate<E> &neg)
             {
                 if (neg._isConcrete) os << neg._value;
@@ -64,9 +71,21 @@ namespace benzaiten
     };
 
     template <typename E>
-    FunctionNegate<E> operator-(FunctionExpression<E> const& fn)
+    struct IsNegate : public std::false_type { };
+
+    template <typename E>
+    struct IsNegate<FunctionNegate<E>> : public std::true_type { };
+
+    /// Negation, folding constants and cancelling double negations
+    template <typename E>
+    auto operator-(FunctionExpression<E> const& fn)
     {
-        return FunctionNegate<E>(static_cast<E const&>(fn));
+        const E &f = static_cast<E const&>(fn);
+
+        if constexpr (IsZero<E>::value) return f;
+        else if constexpr (IsConstant<E>::value) return Constant(-f.getValue());
+        else if constexpr (IsNegate<E>::value) return f.getOperand();
+        else return FunctionNegate<E>(f);
     }
 }
 
@@ -0,0 +1,242 @@
+#ifndef _BZPARALLEL_HH_
+#define _BZPARALLEL_HH_
+
+#include "bzbind.hh"
+#include "bzbatch.hh"
+#include "bztape.hh"
+#include "bzsimd.hh"
+
+#include <mutex>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <condition_variable>
+
+namespace benzaiten
+{
+    /**
+     * A fixed set of worker threads running loops over independent items.
+     * Each worker starts on its own contiguous share of the items and, once
+     * that is exhausted, steals the remaining items of the others. Items are
+     * claimed with a single atomic increment; the only locks are taken to
+     * start and finish a loop.
+     */
+    struct ThreadPool
+    {
+        /// Start a pool of `threads` workers, counting the calling thread
+        ThreadPool(size_t threads = std::thread::hardware_concurrency()) :
+            shares(new Share[std::max<size_t>(threads, 1)]),
+                numShares(std::max<size_t>(threads, 1))
+        {
+            for (size_t w = 1; w < numShares; ++w)
+            {
+                workers.emplace_back([this, w]() { serve(w); });
+            }
+        }
+
+        ThreadPool(const ThreadPool &other) = delete;
+
+        ThreadPool& operator=(const ThreadPool &other) = delete;
+
+        ~ThreadPool()
+        {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                stopping = true;
+            }
+
+            wake.notify_all();
+            for (std::thread &t : workers) t.join();
+        }
+
+        /// @return Number of workers, including the thread calling `parallelFor`
+        size_t size() const { return numShares; }
+
+        /**
+         * Call `fn(item, worker)` once for every item below `count` and
+         * return when all calls are done. The worker index is below `size()`
+         * and is never used by two calls at the same time, so it can select
+         * per-worker scratch space. Loops must not be nested.
+         */
+        template <typename F>
+        void parallelFor(size_t count, F &&fn)
+        {
+            if (count == 0) return;
+
+            for (size_t w = 0; w < numShares; ++w)
+            {
+                shares[w].next.store(count * w / numShares, std::memory_order_relaxed);
+                shares[w].end = count * (w + 1) / numShares;
+            }
+
+            callable = &fn;
+            invoke = [](const void *f, size_t item, size_t worker)
+            {
+                (*static_cast<typename std::remove_reference<F>::type*>(
+                    const_cast<void*>(f)))(item, worker);
+            };
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                active = workers.size();
+                ++generation;
+            }
+
+            wake.notify_all();
+            work(0);
+
+            std::unique_lock<std::mutex> lock(mutex);
+            finished.wait(lock, [this]() { return active == 0; });
+        }
+
+        private:
+            /// The items initially assigned to one worker
+            struct alignas(64) Share
+            {
+                std::atomic<size_t> next;
+                size_t end;
+            };
+
+            void serve(size_t worker)
+            {
+                size_t seen = 0;
+
+                while (true)
+                {
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        wake.wait(lock, [&]() { return stopping || (generation != seen); });
+
+                        if (stopping) return;
+                        seen = generation;
+                    }
+
+                    work(worker);
+
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (--active == 0) finished.notify_one();
+                }
+            }
+
+            void work(size_t worker)
+            {
+                // own share first, then the others in turn
+                for (size_t v = 0; v < numShares; ++v)
+                {
+                    Share &share = shares[(worker + v) % numShares];
+
+                    for (size_t item = share.next.fetch_add(1, std::memory_order_relaxed);
+                        item < share.end; item = share.next.fetch_add(1, std::memory_order_relaxed))
+                    {
+                        invoke(callable, item, worker);
+                    }
+                }
+            }
+
+            std::unique_ptr<Share[]> shares;
+            size_t numShares;
+
+            std::vector<std::thread> workers;
+
+            const void *callable = nullptr;
+            void (*invoke)(const void*, size_t, size_t) = nullptr;
+
+            std::mutex mutex;
+            std::condition_variable wake, finished;
+            size_t generation = 0;
+            size_t active = 0;
+            bool stopping = false;
+    };
+
+    /**
+     * @return Points per tile such that the fields read and written for a
+     * tile stay within a typical 256 KiB L2 cache
+     */
+    inline size_t tileSize(size_t numFields)
+    {
+        const size_t cache = 256 * 1024;
+        size_t points = cache / (sizeof(double) * (numFields + 1));
+
+        return std::max<size_t>(64, points / 64 * 64);
+    }
+
+    /**
+     * Evaluate a plan at `n` points on a thread pool, writing `out[i]` for
+     * each. Points are split into tiles of `tile` points; each output is
+     * written by exactly one call, so the result does not depend on the
+     * schedule.
+     */
+    template <typename E>
+    void evaluate(const Plan<E> &plan, const FieldLayout &layout, double *out,
+        size_t n, ThreadPool &pool, size_t tile = 0)
+    {
+        if (tile == 0) tile = tileSize(layout.getSchema().size());
+
+        const E &expr = plan.expression();
+        const size_t *slots = plan.leafSlots().data();
+
+        pool.parallelFor((n + tile - 1) / tile, [&](size_t t, size_t /*worker*/)
+        {
+            size_t end = std::min(n, (t + 1) * tile);
+
+            for (size_t i = t * tile; i < end; ++i)
+            {
+                FieldReader reader(layout, slots, i);
+                out[i] = expr.evaluate(reader);
+            }
+        });
+    }
+
+    /// Evaluate a plan at the listed points, writing `out[k]` for `indices[k]`
+    template <typename E>
+    void evaluate(const Plan<E> &plan, const FieldLayout &layout, const size_t *indices,
+        double *out, size_t count, ThreadPool &pool, size_t tile = 0)
+    {
+        if (tile == 0) tile = tileSize(layout.getSchema().size());
+
+        const E &expr = plan.expression();
+        const size_t *slots = plan.leafSlots().data();
+
+        pool.parallelFor((count + tile - 1) / tile, [&](size_t t, size_t /*worker*/)
+        {
+            size_t end = std::min(count, (t + 1) * tile);
+
+            for (size_t k = t * tile; k < end; ++k)
+            {
+                FieldReader reader(layout, slots, indices[k]);
+                out[k] = expr.evaluate(reader);
+            }
+        });
+    }
+
+    template <typename E>
+    void evaluate(FunctionExpression<E> const& expr, const FieldLayout &layout,
+        double *out, size_t n, ThreadPool &pool, size_t tile = 0)
+    {
+        evaluate(bind(expr, layout.getSchema()), layout, out, n, pool, tile);
+    }
+
+    /**
+     * Evaluate a tape at `n` points on a thread pool with the vector
+     * kernels, writing `out[i]` for each. Every worker has its own register
+     * file, allocated before the loop starts.
+     */
+    inline void evaluate(const Tape &tape, const FieldLayout &layout, double *out,
+        size_t n, ThreadPool &pool, SimdLevel level = detectSimd(), size_t tile = 0)
+    {
+        if (tile == 0) tile = tileSize(tape.numInputs());
+
+        std::vector<std::vector<double>> regs(pool.size(), simdWorkspace(tape));
+
+        pool.parallelFor((n + tile - 1) / tile, [&](size_t t, size_t worker)
+        {
+            evaluate(tape, layout, out, t * tile, std::min(n, (t + 1) * tile),
+                regs[worker].data(), level);
+        });
+    }
+}
+
+#endif      // _BZPARALLEL_HH_
+
+// vim: set ft=cpp.doxygen:
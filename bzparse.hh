@@ -0,0 +1,347 @@
+#ifndef _BZPARSE_HH_
+#define _BZPARSE_HH_
+
+#include "bzdag.hh"
+
+#include <string>
+#include <cctype>
+#include <charconv>
+#include <optional>
+#include <unordered_map>
+
+namespace benzaiten
+{
+    /**
+     * Parser of infix expressions into runtime expressions, so that
+     * equations can be read from configuration instead of compiled in.
+     *
+     * The text is a list of declarations followed by one expression, each
+     * ended by `;` except the expression, with `#` starting a comment that
+     * runs to the end of the line:
+     *
+     *     Variable t : Temporal, x : Spatial, y : Spatial;
+     *     Function f(t, x, y), g(x, t);
+     *     f * sin(g) + exp(-x ^ 2) / 2
+     *
+     * Expressions use `+ - * / ^`, where `^` binds tightest and groups to
+     * the right, and the functions `log`, `exp`, `sqrt`, `pow`, `sin`,
+     * `cos`, `tan`, `cot`, `sec`, `csc` and their hyperbolic versions. A
+     * function is written by its name alone, or with its arguments as
+     * declared. Names may also be declared by the caller before parsing,
+     * and stay declared from one parse to the next.
+     */
+    struct ExpressionParser
+    {
+        ExpressionParser(DagArena &arena) : arena(arena) { }
+
+        ExpressionParser& variable(const std::string &name, VariableType type = Other)
+        {
+            symbols[name] = arena.variable(name, type);
+            return *this;
+        }
+
+        ExpressionParser& function(const std::string &name, const std::vector<std::string> &args)
+        {
+            symbols[name] = arena.function(name, args);
+            return *this;
+        }
+
+        /// A name that reads as a fixed value, such as a coefficient
+        ExpressionParser& constant(const std::string &name, double value)
+        {
+            symbols[name] = arena.constant(value);
+            return *this;
+        }
+
+        /**
+         * @return The expression in `text`, or nothing if it does not parse,
+         * in which case `error` and `errorPosition` tell why and where
+         */
+        std::optional<DagExpression> parse(const std::string &text)
+        {
+            src = text.c_str();
+            end = src + text.size();
+            pos = src;
+            message.clear();
+
+            while (declaration()) { }
+            if (!message.empty()) return std::nullopt;
+
+            const DagNode *n = sum();
+
+            if (message.empty() && (skip() != end)) fail("expected an operator");
+            if (!message.empty()) return std::nullopt;
+
+            return DagExpression(arena, n);
+        }
+
+        /// @return Why the last parse failed, or an empty string
+        const std::string& error() const { return message; }
+
+        /// @return Offset in the text of the last failure
+        size_t errorPosition() const { return errorAt; }
+
+        private:
+            /// @return Whether a declaration was read
+            bool declaration()
+            {
+                const char *start = skip();
+                std::string kind = identifier();
+
+                if ((kind != "Variable") && (kind != "Function"))
+                {
+                    pos = start;
+                    return false;
+                }
+
+                do
+                {
+                    std::string name = identifier();
+                    if (name.empty()) return fail("expected a name");
+
+                    if (kind == "Variable")
+                    {
+                        VariableType type = Other;
+
+                        if (accept(':'))
+                        {
+                            const char *at = skip();
+                            std::string t = identifier();
+
+                            if (t == "Spatial") type = Spatial;
+                            else if (t == "Temporal") type = Temporal;
+                            else if (t != "Other")
+                            {
+                                pos = at;
+                                return fail("expected Spatial, Temporal or Other");
+                            }
+                        }
+
+                        variable(name, type);
+                    }
+                    else
+                    {
+                        std::vector<std::string> args;
+                        if (!accept('(')) return fail("expected the arguments of " + name);
+
+                        do
+                        {
+                            std::string arg = identifier();
+                            if (arg.empty()) return fail("expected an argument name");
+                            args.push_back(arg);
+                        }
+                        while (accept(','));
+
+                        if (!accept(')')) return fail("expected ')'");
+                        function(name, args);
+                    }
+                }
+                while (accept(','));
+
+                if (!accept(';')) return fail("expected ';' after a declaration");
+                return true;
+            }
+
+            const DagNode* sum()
+            {
+                const DagNode *lhs = product();
+
+                while (message.empty())
+                {
+                    if (accept('+')) lhs = combine(DagOp::Add, lhs, product());
+                    else if (accept('-')) lhs = combine(DagOp::Sub, lhs, product());
+                    else break;
+                }
+
+                return lhs;
+            }
+
+            const DagNode* product()
+            {
+                const DagNode *lhs = unary();
+
+                while (message.empty())
+                {
+                    if (accept('*')) lhs = combine(DagOp::Mul, lhs, unary());
+                    else if (accept('/')) lhs = combine(DagOp::Div, lhs, unary());
+                    else break;
+                }
+
+                return lhs;
+            }
+
+            /// Signs bind looser than powers, so `-x ^ 2` is `-(x ^ 2)`
+            const DagNode* unary()
+            {
+                if (accept('-')) return combine(DagOp::Neg, unary(), nullptr);
+                if (accept('+')) return unary();
+
+                return power();
+            }
+
+            const DagNode* power()
+            {
+                const DagNode *base = primary();
+                if (message.empty() && accept('^')) return combine(DagOp::Pow, base, unary());
+
+                return base;
+            }
+
+            const DagNode* primary()
+            {
+                const char *start = skip();
+
+                if (accept('('))
+                {
+                    const DagNode *n = sum();
+                    if (message.empty() && !accept(')')) fail("expected ')'");
+                    return n;
+                }
+
+                if ((pos != end) && (std::isdigit(static_cast<unsigned char>(*pos)) || (*pos == '.')))
+                {
+                    double value;
+                    auto result = std::from_chars(pos, end, value);
+
+                    if (result.ec != std::errc()) return failure("malformed number");
+                    pos = result.ptr;
+
+                    return arena.constant(value);
+                }
+
+                std::string name = identifier();
+                if (name.empty()) return failure("expected an expression");
+
+                auto it = symbols.find(name);
+                if (it != symbols.end()) return leaf(it->second, start);
+
+                static const std::unordered_map<std::string, DagOp> functions = {
+                    { "log", DagOp::Log }, { "exp", DagOp::Exp },
+                    { "sin", DagOp::Sin }, { "cos", DagOp::Cos }, { "tan", DagOp::Tan },
+                    { "cot", DagOp::Cot }, { "sec", DagOp::Sec }, { "csc", DagOp::Csc },
+                    { "sinh", DagOp::Sinh }, { "cosh", DagOp::Cosh }, { "tanh", DagOp::Tanh },
+                    { "coth", DagOp::Coth }, { "sech", DagOp::Sech }, { "csch", DagOp::Csch } };
+
+                bool isSqrt = (name == "sqrt"), isPow = (name == "pow");
+                auto fn = functions.find(name);
+
+                if ((fn == functions.end()) && !isSqrt && !isPow)
+                {
+                    pos = start;
+                    return failure("unknown name " + name);
+                }
+
+                if (!accept('(')) return failure("expected '(' after " + name);
+
+                const DagNode *a = sum(), *b = nullptr;
+                if (isPow && message.empty())
+                {
+                    if (!accept(',')) return failure("expected ','");
+                    b = sum();
+                }
+
+                if (message.empty() && !accept(')')) fail("expected ')'");
+                if (!message.empty()) return nullptr;
+
+                if (isSqrt) return combine(DagOp::Pow, a, arena.constant(0.5));
+                if (isPow) return combine(DagOp::Pow, a, b);
+
+                return combine(fn->second, a, nullptr);
+            }
+
+            /// A declared name, with the arguments of a function checked if written out
+            const DagNode* leaf(const DagNode *n, const char *start)
+            {
+                if ((n->op != DagOp::Function) || !accept('(')) return n;
+
+                for (size_t i = 0; i < n->numArgs; ++i)
+                {
+                    if ((i > 0) && !accept(',')) return failure("expected ','");
+                    if (identifier() != *n->args[i].name)
+                    {
+                        pos = start;
+                        return failure("arguments differ from the declaration of " + *n->name);
+                    }
+                }
+
+                if (!accept(')')) return failure("expected ')'");
+                return n;
+            }
+
+            /// Operands are built with the simplifying operators of DagExpression
+            const DagNode* combine(DagOp op, const DagNode *a, const DagNode *b)
+            {
+                if (!message.empty()) return nullptr;
+
+                DagExpression x(arena, a);
+                if (op == DagOp::Neg) return (-x).getNode();
+
+                return apply(op, x, DagExpression(arena, b)).getNode();
+            }
+
+            /// @return Start of the next token, after whitespace and comments
+            const char* skip()
+            {
+                while (pos != end)
+                {
+                    if (std::isspace(static_cast<unsigned char>(*pos))) ++pos;
+                    else if (*pos == '#') while ((pos != end) && (*pos != '\n')) ++pos;
+                    else break;
+                }
+
+                return pos;
+            }
+
+            bool accept(char c)
+            {
+                if ((skip() == end) || (*pos != c)) return false;
+
+                ++pos;
+                return true;
+            }
+
+            std::string identifier()
+            {
+                const char *start = skip();
+
+                if ((pos == end) || !(std::isalpha(static_cast<unsigned char>(*pos)) || (*pos == '_'))) return std::string();
+                while ((pos != end) && (std::isalnum(static_cast<unsigned char>(*pos)) || (*pos == '_'))) ++pos;
+
+                return std::string(start, pos);
+            }
+
+            /// Record the first failure; always false
+            bool fail(const std::string &why)
+            {
+                if (!message.empty()) return false;
+
+                message = why;
+                errorAt = skip() - src;
+
+                return false;
+            }
+
+            const DagNode* failure(const std::string &why)
+            {
+                fail(why);
+                return nullptr;
+            }
+
+            DagArena &arena;
+            std::unordered_map<std::string, const DagNode*> symbols;
+
+            const char *src = nullptr, *end = nullptr, *pos = nullptr;
+            std::string message;
+            size_t errorAt = 0;
+    };
+
+    /// @return The expression in `text`, or nothing if it does not parse
+    inline std::optional<DagExpression> parseExpression(DagArena &arena, const std::string &text)
+    {
+        return ExpressionParser(arena).parse(text);
+    }
+}
+
+#endif      // _BZPARSE_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -5,8 +5,10 @@
 #include "bzfunction.hh"
 #include "bzproduct.hh"
 #include "bzlog.hh"
+#include "bzexp.hh"
 
 #include <cmath>
+#include <type_traits>
 
 namespace benzaiten
 {
@@ -16,55 +18,25 @@ namespace benzaiten
     template <typename E1>
     struct FunctionPowerSimple;
 
-    template <typename F1, typename F2, size_t Order>
-    struct PowerDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionPower<F1, FunctionDifference<F2, Constant>>,
-            FunctionSum<FunctionProduct<F2, typename F1::template deriv_type<1>>,
-            FunctionProduct<FunctionProduct<F1, typename F2::template deriv_type<1>>,
-                FunctionLog<F1>>>, Order - 1>::type;
-    };
-
-    template <typename F1, typename F2>
-    struct PowerDerivativeType<F1, F2, 0>
-    {
-        using type = FunctionPower<F1, F2>;
-    };
-
-    template <typename F, size_t Order>
-    struct SimplePowerDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionProduct<Constant,
-            FunctionPowerSimple<F>>, typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct SimplePowerDerivativeType<F, 0>
-    {
-        using type = FunctionPowerSimple<F>;
-    };
-
     template <typename E1, typename E2>
     struct FunctionPower : public FunctionExpression<FunctionPower<E1, E2>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionPower<E1, FunctionDifference<E2, Constant>>,
-                FunctionSum<FunctionProduct<E2, typename E1::template deriv_type<1>>,
-                    FunctionProduct<FunctionProduct<E1, typename E2::template deriv_type<1>>,
-                FunctionLog<E1>>>, Order - 1>::type;
-
             FunctionPower(const E1 &fn1, const E2 &fn2) : fn1(fn1), fn2(fn2) { }
 
-            template <size_t Order = 1>
-            typename PowerDerivativeType<E1, E2, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
+                else if constexpr (Order > 1)
+                {
+                    // f^g = exp(g log f) composes with a single function
+                    return exp(fn2 * log(fn1)).template derivative<Order>(var);
+                }
                 else
                 {
-                    Constant one(1);
-                    return (pow(fn1, fn2 - one) * (fn2 * fn1.template derivative<1>(var) +
-                        fn1 * fn2.template derivative<1>(var) * log(fn1))).template derivative<Order-1>(var);
+                    return (pow(fn1, fn2 - One()) * (fn2 * fn1.template derivative<1>(var) +
+                        fn1 * fn2.template derivative<1>(var) * log(fn1)));
                 }
             }
 
@@ -87,6 +59,19 @@ namespace benzaiten
                 return FunctionPower<E1, E2>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::pow;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v1 = fn1.evaluate(ctx);
+                auto v2 = fn2.evaluate(ctx);
+
+                return pow(v1, v2);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -107,40 +92,117 @@ namespace benzaiten
             double _value;
     };
 
+    template <typename E>
+    auto pow(FunctionExpression<E> const& fn, double pwr);
+
+    /**
+     * Power of two expressions. Exponents of zero and one are resolved, and
+     * a constant exponent gives a simple power.
+     */
     template <typename E1, typename E2>
-    FunctionPower<E1, E2> operator^(FunctionExpression<E1> const& fn1,
+    auto pow(FunctionExpression<E1> const& fn1,
         FunctionExpression<E2> const& fn2)
     {
-        return FunctionPower<E1, E2>(static_cast<E1 const&>(fn1),
-            static_cast<E2 const&>(fn2));
+        const E1 &f1 = static_cast<E1 const&>(fn1);
+        const E2 &f2 = static_cast<E2 const&>(fn2);
+
+        if constexpr (IsZero<E2>::value) return One();
+        else if constexpr (IsOne<E2>::value) return f1;
+        else if constexpr (IsConstant<E2>::value) return pow(fn1, f2.getValue());
+        else return FunctionPower<E1, E2>(f1, f2);
     }
 
     template <typename E1, typename E2>
-    FunctionPower<E1, E2> pow(FunctionExpression<E1> const& fn1,
+    auto operator^(FunctionExpression<E1> const& fn1,
         FunctionExpression<E2> const& fn2)
     {
-        return FunctionPower<E1, E2>(static_cast<E1 const&>(fn1),
-            static_cast<E2 const&>(fn2));
+        return pow(fn1, fn2);
     }
 
+    /// @return `v^M` by repeated squaring, for any type with a product
+    template <size_t M, typename T>
+    T repeatedProduct(const T &v)
+    {
+        static_assert(M > 0, "the empty product has no type to take");
+
+        if constexpr (M == 1) return v;
+        else
+        {
+            T h = repeatedProduct<M / 2>(v);
+
+            if constexpr (M % 2) return h * h * v;
+            else return h * h;
+        }
+    }
+
+    /**
+     * A constant exponent, classified once so that whole and half-whole
+     * powers up to 32 are evaluated with multiplications, a square root and
+     * a reciprocal instead of `std::pow`.
+     */
+    struct Exponent
+    {
+        Exponent(double value) : value(value)
+        {
+            double twice = 2 * value;
+
+            if ((twice == std::floor(twice)) && (std::fabs(value) <= 32))
+            {
+                reduced = true;
+                half = (static_cast<long>(twice) % 2) != 0;
+                whole = static_cast<unsigned>(std::floor(std::fabs(value)));
+            }
+        }
+
+        double operator()(double u) const
+        {
+            if (!reduced) return std::pow(u, value);
+
+            double r = half ? std::sqrt(u) : 1, b = u;
+
+            for (unsigned m = whole; m > 0; m >>= 1)
+            {
+                if (m & 1) r *= b;
+                b *= b;
+            }
+
+            return (value < 0) ? 1 / r : r;
+        }
+
+        double value;
+        bool reduced = false, half = false;
+        unsigned whole = 0;
+    };
+
     template <typename E1>
     struct FunctionPowerSimple : public FunctionExpression<FunctionPowerSimple<E1>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionProduct<Constant, FunctionPowerSimple<E1>>,
-                typename E1::template deriv_type<1>, Order - 1>::type;
+            FunctionPowerSimple(const E1 &fn1, const Constant &cnst) :
+                fn1(fn1), cnst(cnst), exponent(cnst.getValue()) { }
 
-            FunctionPowerSimple(const E1 &fn1, const Constant &cnst) : fn1(fn1), cnst(cnst) { }
-
-            template <size_t Order = 1>
-            typename SimplePowerDerivativeType<E1, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
+                else if constexpr (Order == 1)
+                {
+                    return cnst * pow(fn1, cnst.getValue() - 1) * fn1.template derivative<1>(var);
+                }
+                else return faaDiBruno<Order>(*this, fn1, var);
+            }
+
+            /// @return `d^K u^c / du^K = c (c - 1) ... (c - K + 1) u^(c - K)` at `u = fn1`
+            template <size_t K>
+            auto outerDerivative() const
+            {
+                if constexpr (K == 0) return *this;
                 else
                 {
-                    return (cnst * pow(fn1, cnst.getValue() - 1) *
-                        fn1.template derivative<1>(var)).template derivative<Order-1>(var);
+                    double coeff = 1;
+                    for (size_t i = 0; i < K; ++i) coeff *= cnst.getValue() - i;
+
+                    return pow(fn1, cnst.getValue() - K) * coeff;
                 }
             }
 
@@ -151,7 +213,7 @@ namespace benzaiten
                 if (fn1.isConcrete())
                 {
                     _isConcrete = true;
-                    _value = std::pow(fn1.getValue(), cnst.getValue());
+                    _value = exponent(fn1.getValue());
                 }
 
                 return *this;
@@ -162,6 +224,23 @@ namespace benzaiten
                 return FunctionPowerSimple<E1>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::pow;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn1.evaluate(ctx);
+
+                if constexpr (std::is_same<decltype(v), double>::value) return exponent(v);
+                else
+                {
+                    auto c = cnst.evaluate(ctx);
+                    return pow(v, c);
+                }
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -177,27 +256,144 @@ namespace benzaiten
         private:
             E1 fn1;
             Constant cnst;
+            Exponent exponent;
+
+            bool _isConcrete = false;
+            double _value;
+    };
+
+    template <int N, typename E>
+    auto pow(FunctionExpression<E> const& fn);
+
+    /**
+     * A power with a whole exponent fixed at compile time, such as
+     * `pow<3>(f)`. It is evaluated by repeated squaring in any context, and
+     * its derivatives are whole powers again, with coefficients computed by
+     * the compiler.
+     */
+    template <typename E1, int N>
+    struct FunctionIntegerPower : public FunctionExpression<FunctionIntegerPower<E1, N>>
+    {
+        public:
+            FunctionIntegerPower(const E1 &fn1) : fn1(fn1) { }
+
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
+            {
+                if constexpr (Order == 0) return *this;
+                else if constexpr (Order == 1)
+                {
+                    return Constant(N) * pow<N - 1>(fn1) * fn1.template derivative<1>(var);
+                }
+                else return faaDiBruno<Order>(*this, fn1, var);
+            }
+
+            /// @return `d^K u^N / du^K = N (N - 1) ... (N - K + 1) u^(N - K)` at `u = fn1`
+            template <size_t K>
+            auto outerDerivative() const
+            {
+                constexpr long coeff = fallingFactorial(K);
+
+                if constexpr (K == 0) return *this;
+                else if constexpr (coeff == 0) return Zero();
+                else if constexpr (N == static_cast<int>(K)) return Constant(coeff);
+                else return pow<N - static_cast<int>(K)>(fn1) * static_cast<double>(coeff);
+            }
+
+            FunctionIntegerPower<E1, N>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
+            {
+                fn1.substituteInPlace(subs);
+
+                if (fn1.isConcrete())
+                {
+                    _isConcrete = true;
+                    _value = power(fn1.getValue(), [](double v) { return 1 / v; });
+                }
+
+                return *this;
+            }
+
+            FunctionIntegerPower<E1, N> substitute(const std::vector<SubstituteEntry> &subs) const
+            {
+                return FunctionIntegerPower<E1, N>(*this).substituteInPlace(subs);
+            }
+
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn1.evaluate(ctx);
+                return power(v, [&](const decltype(v) &p) { return ctx.constant(1) / p; });
+            }
+
+            bool isConcrete() const { return _isConcrete; }
+
+            double getValue() const { return _value; }
+
+            friend std::ostream& operator<<(std::ostream &os, const FunctionIntegerPower<E1, N> &pwr)
+            {
+                if (pwr._isConcrete) os << pwr._value;
+                else os << "(" << pwr.fn1 << " ^ " << N << ")";
+
+                return os;
+            }
+
+        private:
+            static constexpr long fallingFactorial(size_t k)
+            {
+                long r = 1;
+                for (size_t i = 0; i < k; ++i) r *= N - static_cast<long>(i);
+                return r;
+            }
+
+            template <typename T, typename R>
+            static T power(const T &v, R reciprocal)
+            {
+                constexpr size_t m = (N < 0) ? -N : N;
+
+                if constexpr (N < 0) return reciprocal(repeatedProduct<m>(v));
+                else return repeatedProduct<m>(v);
+            }
+
+            E1 fn1;
 
             bool _isConcrete = false;
             double _value;
     };
 
+    /// Whole power fixed at compile time; powers of zero and one are resolved
+    template <int N, typename E>
+    auto pow(FunctionExpression<E> const& fn)
+    {
+        const E &f = static_cast<E const&>(fn);
+
+        if constexpr (N == 0) return One();
+        else if constexpr (N == 1) return f;
+        else if constexpr (IsConstant<E>::value) return Constant(std::pow(f.getValue(), N));
+        else return FunctionIntegerPower<E, N>(f);
+    }
+
     template <typename E>
-    FunctionPowerSimple<E> operator^(FunctionExpression<E> const& fn, double pwr)
+    auto pow(FunctionExpression<E> const& fn, double pwr)
     {
-        return FunctionPowerSimple<E>(static_cast<E const&>(fn), Constant(pwr));
+        const E &f = static_cast<E const&>(fn);
+
+        if constexpr (IsConstant<E>::value) return Constant(std::pow(f.getValue(), pwr));
+        else return FunctionPowerSimple<E>(f, Constant(pwr));
     }
 
     template <typename E>
-    FunctionPowerSimple<E> pow(FunctionExpression<E> const& fn, double pwr)
+    auto operator^(FunctionExpression<E> const& fn, double pwr)
     {
-        return FunctionPowerSimple<E>(static_cast<E const&>(fn), Constant(pwr));
+        return pow(fn, pwr);
     }
 
+    /// The power of one half, simplified as `pow(fn, 0.5)` is
     template <typename E>
-    FunctionPowerSimple<E> sqrt(FunctionExpression<E> const& fn)
+    auto sqrt(FunctionExpression<E> const& fn)
     {
-        return FunctionPowerSimple<E>(static_cast<E const&>(fn), Constant(0.5));
+        return pow(fn, 0.5);
     }
 }
 
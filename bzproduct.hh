@@ -4,6 +4,7 @@
 #include "bzvariable.hh"
 #include "bzfunction.hh"
 #include "bzsum.hh"
+#include "bzhighorder.hh"
 
 namespace benzaiten
 {
@@ -13,41 +14,17 @@ namespace benzaiten
     template <typename E1>
     struct FunctionProductSimple;
 
-    template <typename F1, typename F2, size_t Order>
-    struct ProductDerivativeType
-    {
-        using type =
-            FunctionSum<typename ProductDerivativeType<typename F1::template deriv_type<1>, F2, Order - 1>::type,
-                typename ProductDerivativeType<F1, typename F2::template deriv_type<1>, Order - 1>::type>;
-    };
-
-    template <typename F1, typename F2>
-    struct ProductDerivativeType<F1, F2, 0>
-    {
-        using type = FunctionProduct<F1, F2>;
-    };
-
-    template <typename F1, size_t Order>
-    struct SimpleProductDerivativeType
-    {
-        using type = FunctionProductSimple<typename F1::template deriv_type<Order>>;
-    };
-
     template <typename E1, typename E2>
     struct FunctionProduct : public FunctionExpression<FunctionProduct<E1, E2>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<E1, E2, Order>::type;
-
             FunctionProduct(const E1 &fn1, const E2 &fn2) : fn1(fn1), fn2(fn2) { }
 
-            template <size_t Order = 1>
-            typename ProductDerivativeType<E1, E2, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return (fn1.template derivative<1>(var) * fn2).template derivative<Order-1>(var) +
-                            (fn1 * fn2.template derivative<1>(var)).template derivative<Order-1>(var);
+                else return leibniz<Order>(fn1, fn2, var);
             }
 
             FunctionProduct<E1, E2>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -69,6 +46,17 @@ namespace benzaiten
                 return FunctionProduct<E1, E2>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v1 = fn1.evaluate(ctx);
+                auto v2 = fn2.evaluate(ctx);
+
+                return v1 * v2;
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -89,25 +77,39 @@ namespace benzaiten
             double _value;
     };
 
+    template <typename E1>
+    auto operator*(FunctionExpression<E1> const& fn, double other);
+
+    template <typename E1>
+    auto operator*(double other, FunctionExpression<E1> const& fn);
+
+    /**
+     * Product of two expressions. A factor of zero or one is dropped, and
+     * a constant factor is folded into the other or into a simple product.
+     */
     template <typename E1, typename E2>
-    FunctionProduct<E1, E2> operator*(FunctionExpression<E1> const& fn1,
+    auto operator*(FunctionExpression<E1> const& fn1,
         FunctionExpression<E2> const& fn2)
     {
-        return FunctionProduct<E1, E2>(static_cast<E1 const&>(fn1),
-            static_cast<E2 const&>(fn2));
+        const E1 &f1 = static_cast<E1 const&>(fn1);
+        const E2 &f2 = static_cast<E2 const&>(fn2);
+
+        if constexpr (IsZero<E1>::value || IsZero<E2>::value) return Zero();
+        else if constexpr (IsOne<E1>::value) return f2;
+        else if constexpr (IsOne<E2>::value) return f1;
+        else if constexpr (IsConstant<E1>::value) return f1.getValue() * f2;
+        else if constexpr (IsConstant<E2>::value) return f1 * f2.getValue();
+        else return FunctionProduct<E1, E2>(f1, f2);
     }
 
     template <typename E1>
     struct FunctionProductSimple : public FunctionExpression<FunctionProductSimple<E1>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename SimpleProductDerivativeType<E1, Order>::type;
-
             FunctionProductSimple(const E1 &fn1, const Constant &cnst) : fn1(fn1), cnst(cnst) { }
 
-            template <size_t Order = 1>
-            typename SimpleProductDerivativeType<E1, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return fn1.template derivative<Order>(var) * cnst.getValue();
@@ -139,6 +141,19 @@ namespace benzaiten
                 return FunctionProductSimple<E1>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                if (_isConcrete) return ctx.constant(_value);
+
+                if (cnst.getValue() == 0) return ctx.constant(0);
+
+                auto v = fn1.evaluate(ctx);
+                auto c = cnst.evaluate(ctx);
+
+                return v * c;
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -160,15 +175,19 @@ namespace benzaiten
     };
 
     template <typename E>
-    FunctionProductSimple<E> operator*(FunctionExpression<E> const& fn, double other)
+    auto operator*(FunctionExpression<E> const& fn, double other)
     {
-        return FunctionProductSimple<E>(static_cast<E const&>(fn), Constant(other));
+        const E &f = static_cast<E const&>(fn);
+
+        if constexpr (IsZero<E>::value) return f;
+        else if constexpr (IsConstant<E>::value) return Constant(f.getValue() * other);
+        else return FunctionProductSimple<E>(f, Constant(other));
     }
 
     template <typename E>
-    FunctionProductSimple<E> operator*(double other, FunctionExpression<E> const& fn)
+    auto operator*(double other, FunctionExpression<E> const& fn)
     {
-        return FunctionProductSimple<E>(static_cast<E const&>(fn), Constant(other));
+        return fn * other;
     }
 }
 
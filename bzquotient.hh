@@ -17,58 +17,22 @@ namespace benzaiten
     template <typename E2>
     struct FunctionQuotientSimple2;
 
-    template <typename F1, typename F2, size_t Order>
-    struct QuotientDerivativeType
-    {
-        using type = FunctionDifference<FunctionQuotient<typename F1::template deriv_type<1>, F2>,
-            FunctionQuotient<FunctionProduct<F1, typename F2::template deriv_type<1>>, FunctionProduct<F2, F2>>>;
-    };
-
-    template <typename F1, typename F2>
-    struct QuotientDerivativeType<F1, F2, 0>
-    {
-        using type = FunctionQuotient<F1, F2>;
-    };
-
-    template <typename F1, size_t Order>
-    struct Simple1QuotientDerivativeType
-    {
-        using type = FunctionQuotientSimple1<typename F1::template deriv_type<Order>>;
-    };
-
-    template <typename F1>
-    struct Simple1QuotientDerivativeType<F1, 0>
-    {
-        using type = FunctionQuotientSimple1<F1>;
-    };
-
-    template <typename F2, size_t Order>
-    struct Simple2QuotientDerivativeType
-    {
-        using type = FunctionProductSimple<typename QuotientDerivativeType<FunctionNegate<typename F2::template deriv_type<1>>, FunctionProduct<F2, F2>, Order - 1>::type>;
-    };
-
-    template <typename F2>
-    struct Simple2QuotientDerivativeType<F2, 0>
-    {
-        using type = FunctionQuotientSimple2<F2>;
-    };
-
     template <typename E1, typename E2>
     struct FunctionQuotient : public FunctionExpression<FunctionQuotient<E1, E2>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename QuotientDerivativeType<E1, E2, Order>::type;
-
             FunctionQuotient(const E1 &fn1, const E2 &fn2) : fn1(fn1), fn2(fn2) { }
 
-            template <size_t Order = 1>
-            typename QuotientDerivativeType<E1, E2, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return ((fn1.template derivative<1>(var) / fn2) -
-                    (fn1 * fn2.template derivative<1>(var) / (fn2 * fn2))).template derivative<Order-1>(var);
+                else if constexpr (Order == 1)
+                {
+                    return (fn1.template derivative<1>(var) / fn2) -
+                        (fn1 * fn2.template derivative<1>(var) / (fn2 * fn2));
+                }
+                else return leibniz<Order>(fn1, 1.0 / fn2, var);
             }
 
             FunctionQuotient<E1, E2>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -90,6 +54,17 @@ namespace benzaiten
                 return FunctionQuotient<E1, E2>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v1 = fn1.evaluate(ctx);
+                auto v2 = fn2.evaluate(ctx);
+
+                return v1 / v2;
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -110,25 +85,38 @@ namespace benzaiten
             double _value;
     };
 
+    template <typename E>
+    auto operator/(FunctionExpression<E> const& fn, double other);
+
+    template <typename E>
+    auto operator/(double other, FunctionExpression<E> const& fn);
+
+    /**
+     * Quotient of two expressions. A zero numerator or unit denominator is
+     * dropped, and constants are folded into a simple quotient.
+     */
     template <typename E1, typename E2>
-    FunctionQuotient<E1, E2> operator/(FunctionExpression<E1> const& fn1,
+    auto operator/(FunctionExpression<E1> const& fn1,
         FunctionExpression<E2> const& fn2)
     {
-        return FunctionQuotient<E1, E2>(static_cast<E1 const&>(fn1),
-            static_cast<E2 const&>(fn2));
+        const E1 &f1 = static_cast<E1 const&>(fn1);
+        const E2 &f2 = static_cast<E2 const&>(fn2);
+
+        if constexpr (IsZero<E1>::value) return Zero();
+        else if constexpr (IsOne<E2>::value) return f1;
+        else if constexpr (IsConstant<E2>::value) return f1 / f2.getValue();
+        else if constexpr (IsConstant<E1>::value) return f1.getValue() / f2;
+        else return FunctionQuotient<E1, E2>(f1, f2);
     }
 
     template <typename E1>
     struct FunctionQuotientSimple1 : public FunctionExpression<FunctionQuotientSimple1<E1>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename Simple1QuotientDerivativeType<E1, Order>::type;
-
             FunctionQuotientSimple1(const E1 &fn1, const Constant &cnst) : fn1(fn1), cnst(cnst) { }
 
-            template <size_t Order = 1>
-            typename Simple1QuotientDerivativeType<E1, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return fn1.template derivative<Order>(var) / cnst.getValue();
@@ -152,6 +140,17 @@ namespace benzaiten
                 return FunctionQuotientSimple1<E1>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn1.evaluate(ctx);
+                auto c = cnst.evaluate(ctx);
+
+                return v / c;
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -173,26 +172,39 @@ namespace benzaiten
     };
 
     template <typename E>
-    FunctionQuotientSimple1<E> operator/(FunctionExpression<E> const& fn, double other)
+    auto operator/(FunctionExpression<E> const& fn, double other)
     {
-        return FunctionQuotientSimple1<E>(static_cast<E const&>(fn), Constant(other));
+        const E &f = static_cast<E const&>(fn);
+
+        if constexpr (IsZero<E>::value) return f;
+        else if constexpr (IsConstant<E>::value) return Constant(f.getValue() / other);
+        else return FunctionQuotientSimple1<E>(f, Constant(other));
     }
 
     template <typename E2>
     struct FunctionQuotientSimple2 : public FunctionExpression<FunctionQuotientSimple2<E2>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename Simple2QuotientDerivativeType<E2, Order>::type;
-
-            FunctionQuotientSimple2(const Constant &cnst, const E2 &fn2) : cnst(cnst), fn2(fn2) { }
+            FunctionQuotientSimple2(const Constant &cnst, const E2 &fn2) : fn2(fn2), cnst(cnst) { }
 
-            template <size_t Order = 1>
-            typename Simple2QuotientDerivativeType<E2, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return  cnst.getValue() * (-fn2.template derivative<1>(var) /
-                    (fn2 * fn2)).template derivative<Order - 1>(var);
+                else if constexpr (Order == 1)
+                {
+                    return cnst.getValue() * (-fn2.template derivative<1>(var) / (fn2 * fn2));
+                }
+                else return faaDiBruno<Order>(*this, fn2, var);
+            }
+
+            /// @return `d^K (c / u) / du^K = (-1)^K K! c / u^(K+1)` at `u = fn2`
+            template <size_t K>
+            auto outerDerivative() const
+            {
+                if constexpr (K == 0) return *this;
+                else return pow(fn2, -static_cast<double>(K + 1)) *
+                    (((K % 2) ? -1.0 : 1.0) * factorial(K) * cnst.getValue());
             }
 
             FunctionQuotientSimple2<E2>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -221,6 +233,19 @@ namespace benzaiten
                 return FunctionQuotientSimple2<E2>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                if (_isConcrete) return ctx.constant(_value);
+
+                if (cnst.getValue() == 0) return ctx.constant(0);
+
+                auto v = fn2.evaluate(ctx);
+                auto c = cnst.evaluate(ctx);
+
+                return c / v;
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -242,9 +267,12 @@ namespace benzaiten
     };
 
     template <typename E>
-    FunctionQuotientSimple2<E> operator/(double other, FunctionExpression<E> const& fn)
+    auto operator/(double other, FunctionExpression<E> const& fn)
     {
-        return FunctionQuotientSimple2<E>(Constant(other), static_cast<E const&>(fn));
+        const E &f = static_cast<E const&>(fn);
+
+        if constexpr (IsConstant<E>::value) return Constant(other / f.getValue());
+        else return FunctionQuotientSimple2<E>(Constant(other), f);
     }
 }
 
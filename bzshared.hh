@@ -0,0 +1,153 @@
+#ifndef _BZSHARED_HH_
+#define _BZSHARED_HH_
+
+#include "bzexpression.hh"
+#include "bzvariable.hh"
+#include "bzfunction.hh"
+
+#include <map>
+#include <mutex>
+#include <memory>
+#include <string>
+#include <utility>
+#include <typeinfo>
+#include <typeindex>
+#include <type_traits>
+
+namespace benzaiten
+{
+    template <typename E>
+    struct SharedExpression;
+
+    template <typename E>
+    struct IsShared : public std::false_type { };
+
+    template <typename E>
+    struct IsShared<SharedExpression<E>> : public std::true_type { };
+
+    /**
+     * Whether a context keeps the value of each shared subexpression, by
+     * providing `shared(key, compute)`, which returns the value recorded
+     * under `key` or else records the value returned by `compute()`
+     */
+    template <typename C, typename F, typename = void>
+    struct SharesValues : public std::false_type { };
+
+    template <typename C, typename F>
+    struct SharesValues<C, F, std::void_t<decltype(std::declval<const C&>().shared(
+        std::declval<const void*>(), std::declval<F&>()))>> : public std::true_type { };
+
+    template <typename E>
+    auto ref(FunctionExpression<E> const& expr);
+
+    /**
+     * A subexpression stored once and referred to by every expression
+     * built from it; see `ref`. The subexpression is immutable and owned
+     * jointly by its references, so copying one copies a pointer.
+     *
+     * First derivatives are kept with the subexpression, so every reference
+     * to it shares one derivative by each variable, itself shared; higher
+     * orders are taken from the shared first derivative in turn. Contexts
+     * that keep shared values, such as a TapeBuilder, trace the
+     * subexpression once however many times it is used, so a compiled tape
+     * computes it once per point.
+     */
+    template <typename E>
+    struct SharedExpression : public FunctionExpression<SharedExpression<E>>
+    {
+        public:
+            SharedExpression(const E &expr) : node(std::make_shared<Node>(expr)) { }
+
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
+            {
+                if constexpr (Order == 0) return *this;
+                else if constexpr (Order > 1) return derivative<1>(var).template derivative<Order - 1>(var);
+                else
+                {
+                    using D = decltype(ref(node->expr.template derivative<1>(var)));
+
+                    // variables of other types, such as static ones, are told apart by their type
+                    const std::string *name = nullptr;
+                    if constexpr (std::is_same<V, Variable>::value) name = var.internedName();
+
+                    std::lock_guard<std::mutex> lock(node->mutex);
+
+                    std::shared_ptr<void> &d = node->derivatives[{ std::type_index(typeid(V)), name }];
+                    if (!d) d = std::make_shared<D>(ref(node->expr.template derivative<1>(var)));
+
+                    return *std::static_pointer_cast<D>(d);
+                }
+            }
+
+            /// Substituting makes a new subexpression, since this one is shared
+            SharedExpression<E>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
+            {
+                node = std::make_shared<Node>(node->expr.substitute(subs));
+                return *this;
+            }
+
+            SharedExpression<E> substitute(const std::vector<SubstituteEntry> &subs) const
+            {
+                return SharedExpression<E>(*this).substituteInPlace(subs);
+            }
+
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                auto compute = [&]() { return node->expr.evaluate(ctx); };
+
+                if constexpr (SharesValues<C, decltype(compute)>::value) return ctx.shared(node.get(), compute);
+                else return compute();
+            }
+
+            bool isConcrete() const { return node->expr.isConcrete(); }
+
+            double getValue() const { return node->expr.getValue(); }
+
+            const E& expression() const { return node->expr; }
+
+            friend std::ostream& operator<<(std::ostream &os, const SharedExpression<E> &shared)
+            {
+                os << shared.node->expr;
+                return os;
+            }
+
+        private:
+            struct Node
+            {
+                Node(const E &expr) : expr(expr) { }
+
+                const E expr;
+
+                /// Shared first derivatives, by variable type and interned variable name
+                std::mutex mutex;
+                std::map<std::pair<std::type_index, const std::string*>, std::shared_ptr<void>> derivatives;
+            };
+
+            std::shared_ptr<Node> node;
+    };
+
+    /**
+     * @return A reference to a single shared copy of `expr`, for a
+     * subexpression used several times, as in
+     *
+     *     auto u = ref(f * g);
+     *     auto e = sin(u) + u * exp(u);
+     *
+     * Constants, whose type is already their value, are returned as they
+     * are, so the operators can still fold them
+     */
+    template <typename E>
+    auto ref(FunctionExpression<E> const& expr)
+    {
+        const E &e = static_cast<E const&>(expr);
+
+        if constexpr (IsConstant<E>::value || IsShared<E>::value) return e;
+        else return SharedExpression<E>(e);
+    }
+}
+
+#endif      // _BZSHARED_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,562 @@
+#ifndef _BZSIMD_HH_
+#define _BZSIMD_HH_
+
+#include "bztape.hh"
+#include "bzbatch.hh"
+
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define BZ_SIMD_X86 1
+#endif
+
+#if defined(__GNUC__)
+#define BZ_SIMD_INLINE __attribute__((always_inline)) inline
+#else
+#define BZ_SIMD_INLINE inline
+#endif
+
+namespace benzaiten
+{
+    enum class SimdLevel
+    {
+        Baseline,
+        AVX2,
+        AVX512
+    };
+
+    inline const char* simdLevelName(SimdLevel level)
+    {
+        switch (level)
+        {
+            case SimdLevel::AVX512: return "avx512";
+            case SimdLevel::AVX2: return "avx2";
+            default: return "baseline";
+        }
+    }
+
+    /// @return The widest instruction set supported by this processor
+    inline SimdLevel detectSimd()
+    {
+#ifdef BZ_SIMD_X86
+        static const SimdLevel level = []()
+        {
+            __builtin_cpu_init();
+
+            if (__builtin_cpu_supports("avx512f")) return SimdLevel::AVX512;
+            if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return SimdLevel::AVX2;
+            return SimdLevel::Baseline;
+        }();
+
+        return level;
+#else
+        return SimdLevel::Baseline;
+#endif
+    }
+
+#ifdef __GNUC__
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+    /**
+     * Lane-parallel kernels for evaluating a tape over blocks of points.
+     * Every function here is written against GCC vector extensions with `W`
+     * lanes and without branches, so that it compiles to straight-line
+     * vector code for whichever instruction set the caller was built for.
+     */
+    namespace simd
+    {
+        /// Points evaluated together; each register holds one block
+        constexpr size_t blockSize = 64;
+
+        /// Arguments beyond this bound are reduced by libm, one lane at a time
+        constexpr double trigBound = 1e5;
+
+        template <size_t W>
+        struct Lanes
+        {
+            typedef double V __attribute__((vector_size(8 * W)));
+            typedef uint64_t U __attribute__((vector_size(8 * W)));
+            typedef int64_t S __attribute__((vector_size(8 * W)));
+        };
+
+        constexpr double shifter = 0x1.8p52;
+        constexpr uint64_t shifterBits = 0x4338000000000000ULL;
+        constexpr uint64_t oneBits = 0x3ff0000000000000ULL;
+        constexpr uint64_t signMask = 0x8000000000000000ULL;
+        constexpr double ln2hi = 6.93147180369123816490e-01;
+        constexpr double ln2lo = 1.90821492927058770002e-10;
+        constexpr double pio2_1 = 1.57079632673412561417e+00;
+        constexpr double pio2_2 = 6.07710050630396597660e-11;
+        constexpr double pio2_3 = 2.02226624871116645580e-21;
+
+        // Vectors are passed by reference throughout so that these functions
+        // have no vector arguments or return values at any ABI boundary.
+
+        template <size_t W>
+        BZ_SIMD_INLINE void load(typename Lanes<W>::V &v, const double *p)
+        {
+            std::memcpy(&v, p, sizeof(v));
+        }
+
+        template <size_t W>
+        BZ_SIMD_INLINE void store(double *p, const typename Lanes<W>::V &v)
+        {
+            std::memcpy(p, &v, sizeof(v));
+        }
+
+        /// 2^Scale exp(x) to within 1 ulp, including subnormal results
+        template <size_t W, int Scale = 0>
+        BZ_SIMD_INLINE void exp(typename Lanes<W>::V &y, const typename Lanes<W>::V &x)
+        {
+            using V = typename Lanes<W>::V;
+            using U = typename Lanes<W>::U;
+            using S = typename Lanes<W>::S;
+
+            // x = n ln(2) + r, with n read back from the low mantissa bits
+            V t = x * 0x1.71547652b82fep0 + shifter;
+            V n = t - shifter;
+            U k = (U)t - shifterBits + Scale;
+            V r = (x - n * ln2hi) - n * ln2lo;
+
+            V p = r * (1. / 6227020800.) + 1. / 479001600.;
+            p = p * r + 1. / 39916800.;
+            p = p * r + 1. / 3628800.;
+            p = p * r + 1. / 362880.;
+            p = p * r + 1. / 40320.;
+            p = p * r + 1. / 5040.;
+            p = p * r + 1. / 720.;
+            p = p * r + 1. / 120.;
+            p = p * r + 1. / 24.;
+            p = p * r + 1. / 6.;
+            p = p * r + 0.5;
+            p = p * r + 1.;
+            p = p * r + 1.;
+
+            // scale by 2^n in two steps so that subnormal results survive
+            U k1 = (U)((S)k >> 1), k2 = k - k1;
+            V z = p * (V)((k1 + 1023) << 52) * (V)((k2 + 1023) << 52);
+
+            z = (x > 709.782712893384 - Scale * 0.6931471805599453) ? HUGE_VAL : z;
+            z = (x < -745.2) ? 0. : z;
+            y = (x != x) ? x : z;
+        }
+
+        /// log(x) to within 2 ulp
+        template <size_t W>
+        BZ_SIMD_INLINE void log(typename Lanes<W>::V &y, const typename Lanes<W>::V &x)
+        {
+            using V = typename Lanes<W>::V;
+            using U = typename Lanes<W>::U;
+
+            const V one = V{ } + 1.;
+            const U zero = { };
+
+            // normalize subnormal inputs before splitting off the exponent
+            auto tiny = x < DBL_MIN;
+            V xs = x * (tiny ? one * 0x1p54 : one);
+
+            U b = (U)xs;
+            U e = (b >> 52) - 1023 - (tiny ? zero + 54 : zero);
+            V m = (V)((b & 0x000fffffffffffffULL) | oneBits);
+
+            // keep the mantissa within [sqrt(1/2), sqrt(2))
+            auto big = m > 1.4142135623730951;
+            m = m * (big ? one * 0.5 : one);
+            e = e + (big ? zero + 1 : zero);
+
+            V ed = (V)(shifterBits + e) - shifter;
+
+            // log(m) = 2 atanh(s)
+            V s = (m - 1.) / (m + 1.), s2 = s * s;
+            V p = s2 * (1. / 23.) + 1. / 21.;
+            p = p * s2 + 1. / 19.;
+            p = p * s2 + 1. / 17.;
+            p = p * s2 + 1. / 15.;
+            p = p * s2 + 1. / 13.;
+            p = p * s2 + 1. / 11.;
+            p = p * s2 + 1. / 9.;
+            p = p * s2 + 1. / 7.;
+            p = p * s2 + 1. / 5.;
+            p = p * s2 + 1. / 3.;
+
+            V z = ed * ln2hi + ((2. * s + 2. * s * s2 * p) + ed * ln2lo);
+
+            z = (x == HUGE_VAL) ? x : z;
+            z = (x == 0.) ? -HUGE_VAL : z;
+            z = (x < 0.) ? NAN : z;
+            y = (x != x) ? x : z;
+        }
+
+        /// sin(x) and cos(x) to within 2 ulp for |x| <= trigBound
+        template <size_t W>
+        BZ_SIMD_INLINE void sincos(typename Lanes<W>::V &sn, typename Lanes<W>::V &cs,
+            const typename Lanes<W>::V &x)
+        {
+            using V = typename Lanes<W>::V;
+            using U = typename Lanes<W>::U;
+
+            // x = q pi/2 + r with a three-part Cody-Waite reduction
+            V t = x * 0x1.45f306dc9c883p-1 + shifter;
+            V kd = t - shifter;
+            U q = (U)t - shifterBits;
+            V r = ((x - kd * pio2_1) - kd * pio2_2) - kd * pio2_3;
+            V r2 = r * r;
+
+            V ps = r2 * (-1. / 121645100408832000.) + 1. / 355687428096000.;
+            ps = ps * r2 - 1. / 1307674368000.;
+            ps = ps * r2 + 1. / 6227020800.;
+            ps = ps * r2 - 1. / 39916800.;
+            ps = ps * r2 + 1. / 362880.;
+            ps = ps * r2 - 1. / 5040.;
+            ps = ps * r2 + 1. / 120.;
+            ps = ps * r2 - 1. / 6.;
+            V S = r + r * r2 * ps;
+
+            V pc = r2 * (1. / 2432902008176640000.) - 1. / 6402373705728000.;
+            pc = pc * r2 + 1. / 20922789888000.;
+            pc = pc * r2 - 1. / 87178291200.;
+            pc = pc * r2 + 1. / 479001600.;
+            pc = pc * r2 - 1. / 3628800.;
+            pc = pc * r2 + 1. / 40320.;
+            pc = pc * r2 - 1. / 720.;
+            pc = pc * r2 + 1. / 24.;
+            pc = pc * r2 - 0.5;
+            V C = 1. + r2 * pc;
+
+            auto swap = (q & 1) != 0;
+            V ss = swap ? C : S, cc = swap ? S : C;
+
+            sn = ((q & 2) != 0) ? -ss : ss;
+            cs = (((q + 1) & 2) != 0) ? -cc : cc;
+        }
+
+        /// sinh(x) and cosh(x), accurate near zero
+        template <size_t W>
+        BZ_SIMD_INLINE void sinhcosh(typename Lanes<W>::V &sh, typename Lanes<W>::V &ch,
+            const typename Lanes<W>::V &x)
+        {
+            using V = typename Lanes<W>::V;
+            using U = typename Lanes<W>::U;
+
+            U sign = (U)x & signMask;
+            V ax = (V)((U)x & ~signMask);
+
+            // e^|x| / 2, which stays finite as long as cosh(x) does
+            V e;
+            exp<W, -1>(e, ax);
+
+            V x2 = x * x;
+            V p = x2 * (1. / 6227020800.) + 1. / 39916800.;
+            p = p * x2 + 1. / 362880.;
+            p = p * x2 + 1. / 5040.;
+            p = p * x2 + 1. / 120.;
+            p = p * x2 + 1. / 6.;
+
+            ch = e + 0.25 / e;
+            sh = (ax < 0.5) ? x + x * x2 * p : (V)((U)(e - 0.25 / e) | sign);
+        }
+
+        template <size_t W>
+        BZ_SIMD_INLINE void tanh(typename Lanes<W>::V &y, const typename Lanes<W>::V &x)
+        {
+            using V = typename Lanes<W>::V;
+            using U = typename Lanes<W>::U;
+
+            V sh, ch;
+            sinhcosh<W>(sh, ch, x);
+
+            V one = (V)(((U)x & signMask) | oneBits);
+            y = ((x > 22.) | (x < -22.)) ? one : sh / ch;
+        }
+
+        /**
+         * pow(x, y) as exp(y log(x)), so the error grows with |y log(x)|;
+         * lanes for which powNeedsLibm holds must be recomputed by the caller.
+         */
+        template <size_t W>
+        BZ_SIMD_INLINE void pow(typename Lanes<W>::V &z, const typename Lanes<W>::V &x,
+            const typename Lanes<W>::V &y)
+        {
+            typename Lanes<W>::V l;
+            log<W>(l, x);
+            exp<W>(z, y * l);
+        }
+
+        inline bool powNeedsLibm(double x, double y)
+        {
+            return !((x > 0) && (x < HUGE_VAL) && (std::fabs(y) < HUGE_VAL));
+        }
+
+#define BZ_SIMD_LANES(stmt) \
+        for (size_t j = 0; j < blockSize; j += W) \
+        { \
+            V x, y, z; \
+            load<W>(x, a + j); \
+            load<W>(y, b + j); \
+            stmt; \
+            store<W>(d + j, z); \
+        }
+
+#define BZ_SIMD_TRIG(expr, libm) \
+        for (size_t j = 0; j < blockSize; j += W) \
+        { \
+            V x, sn, cs, z; \
+            load<W>(x, a + j); \
+            sincos<W>(sn, cs, x); \
+            z = (expr); \
+            store<W>(tmp + j, z); \
+        } \
+        for (size_t j = 0; j < blockSize; ++j) \
+        { \
+            if (!(std::fabs(a[j]) <= trigBound)) tmp[j] = libm(a[j]); \
+        } \
+        std::memcpy(d, tmp, sizeof(tmp));
+
+#define BZ_SIMD_HYPER(expr) \
+        for (size_t j = 0; j < blockSize; j += W) \
+        { \
+            V x, sh, ch, z; \
+            load<W>(x, a + j); \
+            sinhcosh<W>(sh, ch, x); \
+            z = (expr); \
+            store<W>(d + j, z); \
+        }
+
+        /**
+         * Run every instruction of a tape over one block of points starting
+         * at `start`, of which the first `count` are valid.
+         */
+        template <size_t W>
+        BZ_SIMD_INLINE void runBlock(const Tape &tape, const FieldLayout &layout,
+            size_t start, size_t count, double *regs, double *out)
+        {
+            using V = typename Lanes<W>::V;
+
+            const std::vector<double> &constants = tape.constantTable();
+            double tmp[blockSize];
+
+            for (const TapeInstruction &ins : tape.instructions())
+            {
+                double *d = regs + ins.dst * blockSize;
+                const double *a = regs + ins.a * blockSize;
+                const double *b = regs + ins.b * blockSize;
+
+                switch (ins.op)
+                {
+                    case TapeOp::Load:
+                    {
+                        const double *src = layout.field(ins.a);
+                        size_t stride = layout.stride(ins.a);
+
+                        if (src == nullptr) std::fill(d, d + blockSize, NAN);
+                        else if (stride == 1) std::memcpy(d, src + start, count * sizeof(double));
+                        else for (size_t j = 0; j < count; ++j) d[j] = src[(start + j) * stride];
+
+                        // pad partial blocks with a harmless value
+                        std::fill(d + std::min(count, blockSize), d + blockSize, 1.);
+                        break;
+                    }
+
+                    case TapeOp::Const:
+                        std::fill(d, d + blockSize, constants[ins.a]);
+                        break;
+
+                    case TapeOp::Add: BZ_SIMD_LANES(z = x + y) break;
+                    case TapeOp::Sub: BZ_SIMD_LANES(z = x - y) break;
+                    case TapeOp::Mul: BZ_SIMD_LANES(z = x * y) break;
+                    case TapeOp::Div: BZ_SIMD_LANES(z = x / y) break;
+                    case TapeOp::Neg: BZ_SIMD_LANES(z = -x) break;
+                    case TapeOp::Log: BZ_SIMD_LANES(log<W>(z, x)) break;
+                    case TapeOp::Exp: BZ_SIMD_LANES(exp<W>(z, x)) break;
+
+                    case TapeOp::Pow:
+                    {
+                        for (size_t j = 0; j < blockSize; j += W)
+                        {
+                            V x, y, z;
+                            load<W>(x, a + j);
+                            load<W>(y, b + j);
+                            pow<W>(z, x, y);
+                            store<W>(tmp + j, z);
+                        }
+
+                        for (size_t j = 0; j < blockSize; ++j)
+                        {
+                            if (powNeedsLibm(a[j], b[j])) tmp[j] = std::pow(a[j], b[j]);
+                        }
+
+                        std::memcpy(d, tmp, sizeof(tmp));
+                        break;
+                    }
+
+                    // compilers vectorize this loop to the square root instruction
+                    case TapeOp::Sqrt:
+                        for (size_t j = 0; j < blockSize; ++j) d[j] = std::sqrt(a[j]);
+                        break;
+
+                    case TapeOp::Sin: BZ_SIMD_TRIG(sn, std::sin) break;
+                    case TapeOp::Cos: BZ_SIMD_TRIG(cs, std::cos) break;
+                    case TapeOp::Tan: BZ_SIMD_TRIG(sn / cs, std::tan) break;
+                    case TapeOp::Cot: BZ_SIMD_TRIG(cs / sn, ::cot) break;
+                    case TapeOp::Sec: BZ_SIMD_TRIG(1. / cs, ::sec) break;
+                    case TapeOp::Csc: BZ_SIMD_TRIG(1. / sn, ::csc) break;
+
+                    case TapeOp::Sinh: BZ_SIMD_HYPER(sh) break;
+                    case TapeOp::Cosh: BZ_SIMD_HYPER(ch) break;
+                    case TapeOp::Sech: BZ_SIMD_HYPER(1. / ch) break;
+                    case TapeOp::Csch: BZ_SIMD_HYPER(1. / sh) break;
+                    // both results of one argument; the cosine may be
+                    // written over the argument, which is read first
+                    case TapeOp::SinCos:
+                    {
+                        double *e = regs + ins.b * blockSize;
+                        double cst[blockSize];
+
+                        for (size_t j = 0; j < blockSize; j += W)
+                        {
+                            V x, sn, cs;
+                            load<W>(x, a + j);
+                            sincos<W>(sn, cs, x);
+                            store<W>(tmp + j, sn);
+                            store<W>(cst + j, cs);
+                        }
+
+                        for (size_t j = 0; j < blockSize; ++j)
+                        {
+                            if (!(std::fabs(a[j]) <= trigBound)) fusedSinCos(a[j], tmp[j], cst[j]);
+                        }
+
+                        std::memcpy(d, tmp, sizeof(tmp));
+                        std::memcpy(e, cst, sizeof(cst));
+                        break;
+                    }
+
+                    case TapeOp::SinhCosh:
+                    {
+                        double *e = regs + ins.b * blockSize;
+
+                        for (size_t j = 0; j < blockSize; j += W)
+                        {
+                            V x, sh, ch;
+                            load<W>(x, a + j);
+                            sinhcosh<W>(sh, ch, x);
+                            store<W>(d + j, sh);
+                            store<W>(e + j, ch);
+                        }
+
+                        break;
+                    }
+
+                    case TapeOp::Tanh: BZ_SIMD_LANES(tanh<W>(z, x)) break;
+                    case TapeOp::Coth: BZ_SIMD_LANES(tanh<W>(z, x); z = 1. / z) break;
+                }
+            }
+
+            std::memcpy(out, regs + tape.resultRegister() * blockSize, count * sizeof(double));
+        }
+
+#undef BZ_SIMD_LANES
+#undef BZ_SIMD_TRIG
+#undef BZ_SIMD_HYPER
+
+        template <size_t W>
+        BZ_SIMD_INLINE void run(const Tape &tape, const FieldLayout &layout,
+            double *out, size_t begin, size_t end, double *regs)
+        {
+            for (size_t start = begin; start < end; start += blockSize)
+            {
+                runBlock<W>(tape, layout, start, std::min(blockSize, end - start),
+                    regs, out + start);
+            }
+        }
+
+#ifdef BZ_SIMD_X86
+        __attribute__((target("avx512f")))
+        inline void runAVX512(const Tape &tape, const FieldLayout &layout,
+            double *out, size_t begin, size_t end, double *regs)
+        {
+            run<8>(tape, layout, out, begin, end, regs);
+        }
+
+        __attribute__((target("avx2,fma")))
+        inline void runAVX2(const Tape &tape, const FieldLayout &layout,
+            double *out, size_t begin, size_t end, double *regs)
+        {
+            run<4>(tape, layout, out, begin, end, regs);
+        }
+#endif
+
+        inline void runBaseline(const Tape &tape, const FieldLayout &layout,
+            double *out, size_t begin, size_t end, double *regs)
+        {
+            run<2>(tape, layout, out, begin, end, regs);
+        }
+    }
+
+#pragma GCC diagnostic pop
+#endif
+
+    /// @return Scratch space for evaluating a tape over a range of points
+    inline std::vector<double> simdWorkspace(const Tape &tape)
+    {
+#ifdef __GNUC__
+        return std::vector<double>(tape.numRegisters() * simd::blockSize);
+#else
+        return std::vector<double>(tape.numRegisters() + tape.numInputs());
+#endif
+    }
+
+    /**
+     * Evaluate a tape at the points `begin` to `end`, writing `out[i]` for
+     * each, using the vector kernels for the given instruction set. The
+     * scratch space `regs` must come from `simdWorkspace`.
+     */
+    inline void evaluate(const Tape &tape, const FieldLayout &layout, double *out,
+        size_t begin, size_t end, double *regs, SimdLevel level)
+    {
+#ifdef __GNUC__
+        switch (level)
+        {
+#ifdef BZ_SIMD_X86
+            case SimdLevel::AVX512: simd::runAVX512(tape, layout, out, begin, end, regs); break;
+            case SimdLevel::AVX2: simd::runAVX2(tape, layout, out, begin, end, regs); break;
+#endif
+            default: simd::runBaseline(tape, layout, out, begin, end, regs); break;
+        }
+#else
+        double *in = regs + tape.numRegisters();
+
+        for (size_t i = begin; i < end; ++i)
+        {
+            for (size_t s = 0; s < tape.numInputs(); ++s)
+            {
+                const double *src = layout.field(s);
+                in[s] = (src == nullptr) ? NAN : src[i * layout.stride(s)];
+            }
+
+            out[i] = tape.evaluate(in, regs);
+        }
+#endif
+    }
+
+    /**
+     * Evaluate a tape at `n` points, writing `out[i]` for each, using the
+     * vector kernels for the given instruction set. The tape must have been
+     * compiled against the schema of the layout.
+     */
+    inline void evaluate(const Tape &tape, const FieldLayout &layout,
+        double *out, size_t n, SimdLevel level = detectSimd())
+    {
+        std::vector<double> regs = simdWorkspace(tape);
+        evaluate(tape, layout, out, 0, n, regs.data(), level);
+    }
+}
+
+#endif      // _BZSIMD_HH_
+
+// vim: set ft=cpp.doxygen:
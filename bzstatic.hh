@@ -0,0 +1,261 @@
+#ifndef _BZSTATIC_HH_
+#define _BZSTATIC_HH_
+
+#include "bzexpression.hh"
+#include "bzvariable.hh"
+#include "bzfunction.hh"
+
+#include <type_traits>
+
+namespace benzaiten
+{
+    /**
+     * A variable whose identity is its tag type rather than a runtime name.
+     * The tag only has to provide its printable name, for example
+     *
+     *     struct x_tag { static constexpr const char *name = "x"; };
+     *     using X = StaticVariable<x_tag>;
+     *
+     * Derivatives with respect to a static variable are resolved by the
+     * compiler, so no names are compared while differentiating. Because the
+     * result is a type, differentiate before substituting a value.
+     */
+    template <typename Tag>
+    struct StaticVariable : public FunctionExpression<StaticVariable<Tag>>
+    {
+        static constexpr const char *name = Tag::name;
+
+        std::string getName() const { return Tag::name; }
+
+        /// @return Identity of this variable, see leafKey
+        std::string key() const { return Tag::name; }
+
+        bool operator==(const SubstituteEntry &entry) const
+        {
+            return entry.name == Tag::name;
+        }
+
+        template <size_t Order = 1, typename V>
+        auto derivative(const V &var) const
+        {
+            if constexpr (Order == 0) return *this;
+            else if constexpr ((Order == 1) && std::is_same<V, StaticVariable<Tag>>::value)
+            {
+                return One();
+            }
+            else return Zero();
+        }
+
+        bool isConcrete() const { return _isConcrete; }
+
+        double getValue() const { return _value; }
+
+        StaticVariable<Tag>& substituteInPlace(const std::vector<SubstituteEntry> &entries)
+        {
+            for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+            {
+                if ((*this == *it) && (!_isConcrete))
+                {
+                    _isConcrete = true;
+                    _value = it->value;
+                    break;
+                }
+            }
+
+            return *this;
+        }
+
+        StaticVariable<Tag> substitute(const std::vector<SubstituteEntry> &entries) const
+        {
+            return StaticVariable<Tag>(*this).substituteInPlace(entries);
+        }
+
+        template <typename C>
+        auto evaluate(const C &ctx) const
+        {
+            if (_isConcrete) return ctx.constant(_value);
+            return ctx.lookup(*this);
+        }
+
+        friend std::ostream& operator<<(std::ostream &os, const StaticVariable<Tag> &vbl)
+        {
+            if (vbl._isConcrete) os << vbl._value;
+            else os << Tag::name;
+
+            return os;
+        }
+
+        private:
+            bool _isConcrete = false;
+            double _value = 0;
+    };
+
+    /**
+     * Derivative multi-index of a static function. This is a distinct type
+     * from std::index_sequence so that argument-dependent lookup on static
+     * functions does not reach into namespace std.
+     */
+    template <size_t... Is>
+    struct DerivativeOrders { };
+
+    template <typename Tag, typename Orders, typename... Vars>
+    struct StaticDerivative;
+
+    /// Multi-index of a static function after differentiating by `V`
+    template <typename V, size_t Order, typename Orders, typename... Vars>
+    struct StaticIncrement;
+
+    template <typename V, size_t Order, size_t... Is, typename... Vars>
+    struct StaticIncrement<V, Order, DerivativeOrders<Is...>, Vars...>
+    {
+        using type = DerivativeOrders<(Is + (std::is_same<V, Vars>::value ? Order : 0))...>;
+    };
+
+    /**
+     * A derivative of a function of static variables. The derivative orders
+     * with respect to each of the arguments `Vars` are the multi-index
+     * `Orders`, so differentiating yields a new type, or Zero when the
+     * function does not depend on the variable.
+     */
+    template <typename Tag, size_t... Is, typename... Vars>
+    struct StaticDerivative<Tag, DerivativeOrders<Is...>, Vars...> :
+        public FunctionExpression<StaticDerivative<Tag, DerivativeOrders<Is...>, Vars...>>
+    {
+        static_assert(sizeof...(Is) == sizeof...(Vars),
+            "one derivative order is needed per argument");
+
+        /// Derivative orders, one per argument
+        static constexpr std::array<size_t, sizeof...(Vars)> orders = { Is... };
+
+        template <typename V>
+        static constexpr bool isFunctionOf()
+        {
+            return (std::is_same<V, Vars>::value || ...);
+        }
+
+        template <size_t Order = 1, typename V>
+        auto derivative(const V &) const
+        {
+            if constexpr (Order == 0) return *this;
+            else if constexpr (isFunctionOf<V>())
+            {
+                using Next = typename StaticIncrement<V, Order,
+                    DerivativeOrders<Is...>, Vars...>::type;
+
+                StaticDerivative<Tag, Next, Vars...> deriv;
+                if (_isConcrete) deriv.substituteValue(0);
+                return deriv;
+            }
+            else return Zero();
+        }
+
+        /// @return Names of the variables this function depends on
+        static std::vector<std::string> arguments() { return { Vars::name... }; }
+
+        /// @return Identity of this function and its derivatives, see leafKey
+        std::string key() const
+        {
+            std::unordered_map<std::string, size_t> d;
+            size_t i = 0;
+
+            ((d[Vars::name] += orders[i++]), ...);
+            return leafKey(Tag::name, d);
+        }
+
+        bool operator==(const SubstituteEntry &entry) const
+        {
+            if (entry.name != Tag::name) return false;
+
+            size_t i = 0;
+            bool match = true;
+
+            ((match = match && (orders[i++] == (entry.d.count(Vars::name) ?
+                entry.d.at(Vars::name) : 0))), ...);
+            return match;
+        }
+
+        bool isConcrete() const { return _isConcrete; }
+
+        double getValue() const { return _value; }
+
+        /// Replace this function by a known value; used across derivative types
+        void substituteValue(double value)
+        {
+            _isConcrete = true;
+            _value = value;
+        }
+
+        StaticDerivative& substituteInPlace(const std::vector<SubstituteEntry> &entries)
+        {
+            for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+            {
+                if ((!_isConcrete) && (*this == *it))
+                {
+                    substituteValue(it->value);
+                    break;
+                }
+            }
+
+            return *this;
+        }
+
+        StaticDerivative substitute(const std::vector<SubstituteEntry> &entries) const
+        {
+            return StaticDerivative(*this).substituteInPlace(entries);
+        }
+
+        template <typename C>
+        auto evaluate(const C &ctx) const
+        {
+            if (_isConcrete) return ctx.constant(_value);
+            return ctx.lookup(*this);
+        }
+
+        friend std::ostream& operator<<(std::ostream &os, const StaticDerivative &fn)
+        {
+            if (fn._isConcrete)
+            {
+                os << fn._value;
+                return os;
+            }
+
+            size_t order = (Is + ... + 0);
+            const char *names[] = { Vars::name..., nullptr };
+
+            if (order > 0) os << ((order > 1) ? "d^" + std::to_string(order) : "d") << "(";
+
+            os << Tag::name << "(";
+            for (size_t i = 0; i < sizeof...(Vars); ++i) os << ((i > 0) ? ", " : "") << names[i];
+            os << ")";
+
+            if (order > 0)
+            {
+                os << ")/";
+
+                for (size_t i = 0; i < sizeof...(Vars); ++i)
+                {
+                    if (orders[i] == 0) continue;
+
+                    os << "d(" << names[i] << ")";
+                    if (orders[i] > 1) os << "^" << orders[i];
+                    os << " ";
+                }
+            }
+
+            return os;
+        }
+
+        private:
+            bool _isConcrete = false;
+            double _value = 0;
+    };
+
+    /// A function of static variables, such as `StaticFunction<f_tag, X, T>`
+    template <typename Tag, typename... Vars>
+    using StaticFunction = StaticDerivative<Tag,
+        DerivativeOrders<(0 * sizeof(Vars))...>, Vars...>;
+}
+
+#endif      // _BZSTATIC_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,381 @@
+#ifndef _BZSTENCIL_HH_
+#define _BZSTENCIL_HH_
+
+#include "bzexpression.hh"
+#include "bzbind.hh"
+#include "bzbatch.hh"
+
+#include <cmath>
+#include <map>
+#include <cstddef>
+#include <limits>
+#include <algorithm>
+
+namespace benzaiten
+{
+    /**
+     * A finite-difference formula: a derivative at point `i` is the sum of
+     * `weights[k]` times the function at point `i + offsets[k]`. Offsets
+     * count points in the flattened grid, so on a row-major grid of width
+     * `nx` a neighbour in y is `nx` points away.
+     */
+    struct Stencil
+    {
+        Stencil() { }
+
+        Stencil(const std::vector<std::ptrdiff_t> &offsets, const std::vector<double> &weights) :
+            offsets(offsets), weights(weights) { }
+
+        /// @return The same formula on a grid where neighbours are `stride` points apart
+        Stencil strided(std::ptrdiff_t stride) const
+        {
+            Stencil st = *this;
+            for (std::ptrdiff_t &o : st.offsets) o *= stride;
+            return st;
+        }
+
+        std::vector<std::ptrdiff_t> offsets;
+        std::vector<double> weights;
+    };
+
+    /**
+     * @return Weights of the derivative of order `order` from samples at
+     * `offsets` grid spacings of size `spacing` from the point, by
+     * Fornberg's recurrence; any set of at least `order + 1` distinct
+     * offsets works, one-sided ones included
+     */
+    inline Stencil finiteDifference(size_t order, const std::vector<std::ptrdiff_t> &offsets,
+        double spacing = 1)
+    {
+        const size_t n = offsets.size();
+
+        // c[j][k]: weight of sample j in the derivative of order k
+        std::vector<std::vector<double>> c(n, std::vector<double>(order + 1, 0));
+        double c1 = 1, c4 = offsets[0];
+        c[0][0] = 1;
+
+        for (size_t i = 1; i < n; ++i)
+        {
+            size_t mn = std::min(i, order);
+            double c2 = 1, c5 = c4;
+            c4 = offsets[i];
+
+            for (size_t j = 0; j < i; ++j)
+            {
+                double c3 = static_cast<double>(offsets[i] - offsets[j]);
+                c2 *= c3;
+
+                if (j == i - 1)
+                {
+                    for (size_t k = mn; k > 0; --k) c[i][k] = c1 * (k * c[i - 1][k - 1] - c5 * c[i - 1][k]) / c2;
+                    c[i][0] = -c1 * c5 * c[i - 1][0] / c2;
+                }
+
+                for (size_t k = mn; k > 0; --k) c[j][k] = (c4 * c[j][k] - k * c[j][k - 1]) / c3;
+                c[j][0] = c4 * c[j][0] / c3;
+            }
+
+            c1 = c2;
+        }
+
+        Stencil st;
+        double scale = std::pow(spacing, -static_cast<double>(order));
+
+        for (size_t j = 0; j < n; ++j)
+        {
+            st.offsets.push_back(offsets[j]);
+            st.weights.push_back(c[j][order] * scale);
+        }
+
+        return st;
+    }
+
+    /// @return Half-width of the central difference of an order and even accuracy
+    inline size_t centralRadius(size_t order, size_t accuracy)
+    {
+        return (order + 1) / 2 - 1 + accuracy / 2;
+    }
+
+    /**
+     * @return Points in a one-sided difference of an order and accuracy,
+     * which needs `order + accuracy` of them, one more than the central
+     * difference for even orders; never fewer than the central difference
+     */
+    inline size_t oneSidedWidth(size_t order, size_t accuracy)
+    {
+        return std::max(2 * centralRadius(order, accuracy) + 1, order + accuracy);
+    }
+
+    /**
+     * @return Central difference for the derivative of order `order` with
+     * error of order `accuracy` (which should be even) in the spacing
+     */
+    inline Stencil centralDifference(size_t order, size_t accuracy = 2, double spacing = 1)
+    {
+        std::ptrdiff_t p = centralRadius(order, accuracy);
+        std::vector<std::ptrdiff_t> offsets;
+
+        for (std::ptrdiff_t o = -p; o <= p; ++o) offsets.push_back(o);
+        return finiteDifference(order, offsets, spacing);
+    }
+
+    /**
+     * A uniform grid whose axes are variables. The first axis varies
+     * fastest, so point `i` has coordinate `(i / stride(a)) % size(a)`
+     * along axis `a`.
+     */
+    struct Grid
+    {
+        Grid& axis(const std::string &name, size_t size, double spacing)
+        {
+            strides.push_back(points());
+            names.push_back(name);
+            sizes.push_back(size);
+            spacings.push_back(spacing);
+
+            return *this;
+        }
+
+        size_t numAxes() const { return names.size(); }
+
+        size_t points() const
+        {
+            size_t n = 1;
+            for (size_t s : sizes) n *= s;
+            return n;
+        }
+
+        /// @return Index of the axis along a variable, or npos if there is none
+        size_t find(const std::string &name) const
+        {
+            auto it = std::find(names.begin(), names.end(), name);
+            return (it == names.end()) ? Schema::npos : it - names.begin();
+        }
+
+        size_t size(size_t a) const { return sizes[a]; }
+
+        double spacing(size_t a) const { return spacings[a]; }
+
+        size_t stride(size_t a) const { return strides[a]; }
+
+        private:
+            std::vector<std::string> names;
+            std::vector<size_t> sizes;
+            std::vector<double> spacings;
+            std::vector<size_t> strides;
+    };
+
+    /**
+     * How one leaf is read at every point: directly from a field, or as a
+     * product of one-dimensional differences of its base function. Each
+     * axis has the central formula for interior points and a one-sided
+     * formula of the same accuracy, see oneSidedWidth, for every point
+     * closer to an edge.
+     */
+    struct LeafStencil
+    {
+        struct Axis
+        {
+            size_t axis;
+            size_t radius;
+
+            /// Formulas for the first `radius` points, the interior, then the last `radius`
+            std::vector<Stencil> formulas;
+
+            const Stencil& at(size_t c, size_t n) const
+            {
+                if (c < radius) return formulas[c];
+                if (c + radius >= n) return formulas[2 * radius + 1 - (n - c)];
+                return formulas[radius];
+            }
+        };
+
+        size_t slot = Schema::npos;
+        std::vector<Axis> axes;
+    };
+
+    /**
+     * An expression prepared for evaluation on a grid, where the function
+     * derivatives it reads are computed from the base functions by finite
+     * differences as they are needed. No derivative field is ever stored.
+     *
+     * A leaf with its own field in the layout is read from it, which lets
+     * derivatives by variables that are not grid axes, such as time, be
+     * supplied. Every other derivative by grid axes is differentiated from
+     * the field of its base function with the given accuracy, at the edges
+     * as well as inside, which needs at least oneSidedWidth points along
+     * each axis it differentiates by; leaves that can be resolved neither
+     * way, including those whose axes are too short, evaluate to NaN.
+     */
+    template <typename E>
+    struct StencilPlan
+    {
+        StencilPlan(const E &expr, const Grid &grid, const FieldLayout &layout,
+            size_t accuracy = 2) : expr(expr), grid(grid)
+        {
+            SlotRecorder recorder(keys);
+            SlotAllocator allocator(keys);
+            expr.evaluate(allocator);
+            expr.evaluate(recorder);
+            slots = recorder.slots;
+
+            const Schema &schema = layout.getSchema();
+
+            for (size_t k = 0; k < keys.size(); ++k)
+            {
+                LeafStencil leaf;
+                std::map<std::string, size_t> d;
+                std::string name = parseLeafKey(keys.key(k), d);
+
+                leaf.slot = schema.findKey(keys.key(k));
+
+                if ((leaf.slot == Schema::npos) || (layout.field(leaf.slot) == nullptr))
+                {
+                    leaf.slot = schema.findKey(name);
+
+                    for (auto it = d.cbegin(); it != d.cend(); ++it)
+                    {
+                        // the widest formula must fit on the axis
+                        size_t a = grid.find(it->first);
+
+                        if ((a == Schema::npos) || (grid.size(a) < oneSidedWidth(it->second, accuracy)))
+                        {
+                            leaf.slot = Schema::npos;
+                        }
+                        else leaf.axes.push_back(axis(a, it->second, accuracy));
+                    }
+                }
+
+                if ((leaf.slot != Schema::npos) && (layout.field(leaf.slot) == nullptr)) leaf.slot = Schema::npos;
+                leaves.push_back(leaf);
+            }
+        }
+
+        const E& expression() const { return expr; }
+
+        const Grid& getGrid() const { return grid; }
+
+        /// @return The slot in the plan's own schema of each leaf, in evaluation order
+        const std::vector<size_t>& leafSlots() const { return slots; }
+
+        const LeafStencil& leaf(size_t slot) const { return leaves[slot]; }
+
+        private:
+            LeafStencil::Axis axis(size_t a, size_t order, size_t accuracy) const
+            {
+                LeafStencil::Axis ax;
+                ax.axis = a;
+                ax.radius = centralRadius(order, accuracy);
+
+                const std::ptrdiff_t radius = ax.radius;
+                const std::ptrdiff_t edge = oneSidedWidth(order, accuracy);
+                const std::ptrdiff_t stride = grid.stride(a);
+
+                // formula c has c samples before the point up to the middle
+                // one, which is central, and 2 * radius - c after it past
+                // the middle, so the first formulas lean right and the last
+                // ones lean left
+                for (std::ptrdiff_t c = 0; c <= 2 * radius; ++c)
+                {
+                    std::ptrdiff_t first = (c < radius) ? -c : ((c == radius) ? -radius : 2 * radius - c - edge + 1);
+                    std::ptrdiff_t width = (c == radius) ? 2 * radius + 1 : edge;
+
+                    std::vector<std::ptrdiff_t> offsets;
+                    for (std::ptrdiff_t o = 0; o < width; ++o) offsets.push_back(first + o);
+
+                    ax.formulas.push_back(finiteDifference(order, offsets,
+                        grid.spacing(a)).strided(stride));
+                }
+
+                return ax;
+            }
+
+            E expr;
+            Grid grid;
+
+            Schema keys;
+            std::vector<size_t> slots;
+            std::vector<LeafStencil> leaves;
+    };
+
+    /// Context computing each leaf at one grid point from the fields
+    template <typename E>
+    struct StencilReader
+    {
+        StencilReader(const StencilPlan<E> &plan, const FieldLayout &layout, size_t index) :
+            plan(plan), layout(layout), cursor(plan.leafSlots().data()), index(index) { }
+
+        double constant(double value) const { return value; }
+
+        template <typename L>
+        double lookup(const L &) const
+        {
+            const LeafStencil &ls = plan.leaf(*cursor++);
+
+            if (ls.slot == Schema::npos) return std::numeric_limits<double>::quiet_NaN();
+
+            const double *field = layout.field(ls.slot);
+            const size_t stride = layout.stride(ls.slot);
+
+            if (ls.axes.empty()) return field[index * stride];
+
+            return sum(ls, 0, field, stride, static_cast<std::ptrdiff_t>(index), 1);
+        }
+
+        private:
+            /// Tensor product of the formulas of the axes from `k` on
+            double sum(const LeafStencil &ls, size_t k, const double *field,
+                size_t stride, std::ptrdiff_t at, double weight) const
+            {
+                if (k == ls.axes.size()) return weight * field[at * stride];
+
+                const LeafStencil::Axis &ax = ls.axes[k];
+                const Grid &grid = plan.getGrid();
+                size_t c = (index / grid.stride(ax.axis)) % grid.size(ax.axis);
+
+                const Stencil &st = ax.at(c, grid.size(ax.axis));
+                double total = 0;
+
+                for (size_t j = 0; j < st.offsets.size(); ++j)
+                {
+                    total += sum(ls, k + 1, field, stride, at + st.offsets[j], weight * st.weights[j]);
+                }
+
+                return total;
+            }
+
+            const StencilPlan<E> &plan;
+            const FieldLayout &layout;
+            mutable const size_t *cursor;
+            size_t index;
+    };
+
+    /**
+     * Evaluate an expression at every point of a grid, writing `out[i]`
+     * for each, with function derivatives computed by finite differences
+     * inside the loop; see StencilPlan.
+     */
+    template <typename E>
+    void evaluate(const StencilPlan<E> &plan, const FieldLayout &layout, double *out)
+    {
+        const E &expr = plan.expression();
+        const size_t n = plan.getGrid().points();
+
+        for (size_t i = 0; i < n; ++i)
+        {
+            StencilReader<E> reader(plan, layout, i);
+            out[i] = expr.evaluate(reader);
+        }
+    }
+
+    template <typename E>
+    void evaluate(FunctionExpression<E> const& expr, const Grid &grid,
+        const FieldLayout &layout, double *out, size_t accuracy = 2)
+    {
+        evaluate(StencilPlan<E>(static_cast<E const&>(expr), grid, layout, accuracy), layout, out);
+    }
+}
+
+#endif      // _BZSTENCIL_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -8,31 +8,14 @@ namespace benzaiten
     template <typename E1, typename E2>
     struct FunctionSum;
 
-    template <typename F1, typename F2, size_t Order>
-    struct SumDerivativeType
-    {
-        using type = FunctionSum<typename F1::template deriv_type<Order>,
-            typename F2::template deriv_type<Order>>;
-    };
-
-    template <typename F1, typename F2>
-    struct SumDerivativeType<F1, F2, 0>
-    {
-        using type = FunctionSum<F1, F2>;
-    };
-
     template <typename E1, typename E2>
     struct FunctionSum : public FunctionExpression<FunctionSum<E1, E2>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = FunctionSum<typename E1::template deriv_type<Order>,
-                typename E2::template deriv_type<Order>>;
-
             FunctionSum(const E1 &fn1, const E2 &fn2) : fn1(fn1), fn2(fn2) { }
 
-            template <size_t Order = 1>
-            typename SumDerivativeType<E1, E2, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return fn1.template derivative<Order>(var) + fn2.template derivative<Order>(var);
@@ -57,6 +40,17 @@ namespace benzaiten
                 return FunctionSum<E1, E2>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v1 = fn1.evaluate(ctx);
+                auto v2 = fn2.evaluate(ctx);
+
+                return v1 + v2;
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -77,24 +71,39 @@ namespace benzaiten
             double _value;
     };
 
+    /// Sum of two expressions, dropping zeros and folding constants
     template <typename E1, typename E2>
-    FunctionSum<E1, E2> operator+(FunctionExpression<E1> const& fn1,
+    auto operator+(FunctionExpression<E1> const& fn1,
         FunctionExpression<E2> const& fn2)
     {
-        return FunctionSum<E1, E2>(static_cast<E1 const&>(fn1),
-            static_cast<E2 const&>(fn2));
+        const E1 &f1 = static_cast<E1 const&>(fn1);
+        const E2 &f2 = static_cast<E2 const&>(fn2);
+
+        if constexpr (IsZero<E1>::value) return f2;
+        else if constexpr (IsZero<E2>::value) return f1;
+        else if constexpr (IsConstant<E1>::value && IsConstant<E2>::value)
+        {
+            return Constant(f1.getValue() + f2.getValue());
+        }
+        else return FunctionSum<E1, E2>(f1, f2);
     }
 
     template <typename E>
-    FunctionSum<E, Constant> operator+(FunctionExpression<E> const& fn, double other)
+    auto operator+(FunctionExpression<E> const& fn, double other)
     {
-        return FunctionSum<E, Constant>(static_cast<E const&>(fn), Constant(other));
+        const E &f = static_cast<E const&>(fn);
+
+        if constexpr (IsConstant<E>::value) return Constant(f.getValue() + other);
+        else return FunctionSum<E, Constant>(f, Constant(other));
     }
 
     template <typename E>
-    FunctionSum<Constant, E> operator+(double other, FunctionExpression<E> const& fn)
+    auto operator+(double other, FunctionExpression<E> const& fn)
     {
-        return FunctionSum<Constant, E>(Constant(other), static_cast<E const&>(fn));
+        const E &f = static_cast<E const&>(fn);
+
+        if constexpr (IsConstant<E>::value) return Constant(other + f.getValue());
+        else return FunctionSum<Constant, E>(Constant(other), f);
     }
 }
 
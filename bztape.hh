@@ -0,0 +1,775 @@
+#ifndef _BZTAPE_HH_
+#define _BZTAPE_HH_
+
+#include "bzexpression.hh"
+#include "bzvariable.hh"
+#include "bzfunction.hh"
+#include "bzbind.hh"
+#include "bztrig.hh"
+#include "bzhyperbolic.hh"
+
+#include <cmath>
+#include <limits>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <functional>
+#include <unordered_map>
+#include <iostream>
+
+namespace benzaiten
+{
+    enum class TapeOp : uint8_t
+    {
+        Load,
+        Const,
+        Add,
+        Sub,
+        Mul,
+        Div,
+        Neg,
+        Pow,
+        Sqrt,
+        Log,
+        Exp,
+        Sin,
+        Cos,
+        Tan,
+        Cot,
+        Sec,
+        Csc,
+        Sinh,
+        Cosh,
+        Tanh,
+        Coth,
+        Sech,
+        Csch,
+        SinCos,
+        SinhCosh
+    };
+
+    /**
+     * A single tape instruction, `dst = op(a, b)`. For `Load`, `a` is the
+     * input slot; for `Const`, `a` indexes the constant table. The fused
+     * `SinCos` and `SinhCosh` only appear after register allocation and
+     * write two registers, `dst = sin(a)` and `b = cos(a)`.
+     */
+    struct TapeInstruction
+    {
+        TapeOp op;
+        uint32_t dst, a, b;
+    };
+
+    /// Hash of the operation and operands of an instruction, ignoring `dst`
+    struct TapeOperationHash
+    {
+        size_t operator()(const TapeInstruction &ins) const
+        {
+            uint64_t key = (static_cast<uint64_t>(ins.a) << 32) | ins.b;
+            return std::hash<uint64_t>()(key * 31 + static_cast<uint64_t>(ins.op));
+        }
+    };
+
+    struct TapeOperationEqual
+    {
+        bool operator()(const TapeInstruction &x, const TapeInstruction &y) const
+        {
+            return (x.op == y.op) && (x.a == y.a) && (x.b == y.b);
+        }
+    };
+
+    inline const char* tapeOpName(TapeOp op)
+    {
+        static const char *names[] = { "load", "const", "add", "sub", "mul",
+            "div", "neg", "pow", "sqrt", "log", "exp", "sin", "cos", "tan", "cot",
+            "sec", "csc", "sinh", "cosh", "tanh", "coth", "sech", "csch",
+            "sincos", "sinhcosh" };
+
+        return names[static_cast<size_t>(op)];
+    }
+
+    inline size_t tapeOpArity(TapeOp op)
+    {
+        switch (op)
+        {
+            case TapeOp::Load:
+            case TapeOp::Const:
+                return 0;
+
+            case TapeOp::Add:
+            case TapeOp::Sub:
+            case TapeOp::Mul:
+            case TapeOp::Div:
+            case TapeOp::Pow:
+                return 2;
+
+            default:
+                return 1;
+        }
+    }
+
+    /// @return Whether two traced instructions are the sine and cosine of one argument
+    inline bool isFusedPair(const TapeInstruction &x, const TapeInstruction &y)
+    {
+        return (x.a == y.a) && (((x.op == TapeOp::Sin) && (y.op == TapeOp::Cos)) ||
+            ((x.op == TapeOp::Sinh) && (y.op == TapeOp::Cosh)));
+    }
+
+    /// sin(x) and cos(x), which the compiler merges into a single sincos call
+    inline void fusedSinCos(double x, double &sn, double &cs)
+    {
+        sn = std::sin(x);
+        cs = std::cos(x);
+    }
+
+    /// sinh(x) and cosh(x) from a single expm1, accurate near zero
+    inline void fusedSinhCosh(double x, double &sh, double &ch)
+    {
+        double ax = std::fabs(x);
+
+        // e^|x| overflows just before cosh does
+        if (ax > 709)
+        {
+            sh = std::sinh(x);
+            ch = std::cosh(x);
+            return;
+        }
+
+        double em = std::expm1(ax), ei = 1 / (em + 1);
+
+        sh = std::copysign(0.5 * em * (1 + ei), x);
+        ch = 0.5 * (em + 1) + 0.5 * ei;
+    }
+
+    /**
+     * A flat, register-allocated instruction stream computing the value of
+     * an expression from an array of input values laid out by the schema
+     * given to `compile`.
+     */
+    struct Tape
+    {
+        /// @return Scratch space large enough for the register file
+        std::vector<double> workspace() const
+        {
+            return std::vector<double>(registers);
+        }
+
+        size_t numInputs() const { return inputs; }
+
+        size_t numRegisters() const { return registers; }
+
+        size_t size() const { return code.size(); }
+
+        /**
+         * @return Number of nodes in the expression tree the tape was
+         * compiled from; the difference from `size` is the number of
+         * repeated subexpressions that were eliminated.
+         */
+        size_t treeSize() const { return nodes; }
+
+        const std::vector<TapeInstruction>& instructions() const { return code; }
+
+        const std::vector<double>& constantTable() const { return constants; }
+
+        uint32_t resultRegister() const { return result; }
+
+        /**
+         * @return The instructions before register allocation, where each
+         * instruction writes value number `i` and reads operands by value
+         * number
+         */
+        const std::vector<TapeInstruction>& tracedInstructions() const { return trace; }
+
+        /// @return Value number of the result in `tracedInstructions`
+        uint32_t tracedResult() const { return root; }
+
+        double evaluate(const double *in, double *r) const
+        {
+            for (const TapeInstruction &ins : code)
+            {
+                switch (ins.op)
+                {
+                    case TapeOp::Load:  r[ins.dst] = in[ins.a]; break;
+                    case TapeOp::Const: r[ins.dst] = constants[ins.a]; break;
+                    case TapeOp::Add:   r[ins.dst] = r[ins.a] + r[ins.b]; break;
+                    case TapeOp::Sub:   r[ins.dst] = r[ins.a] - r[ins.b]; break;
+                    case TapeOp::Mul:   r[ins.dst] = r[ins.a] * r[ins.b]; break;
+                    case TapeOp::Div:   r[ins.dst] = r[ins.a] / r[ins.b]; break;
+                    case TapeOp::Neg:   r[ins.dst] = -r[ins.a]; break;
+                    case TapeOp::Pow:   r[ins.dst] = std::pow(r[ins.a], r[ins.b]); break;
+                    case TapeOp::Sqrt:  r[ins.dst] = std::sqrt(r[ins.a]); break;
+                    case TapeOp::Log:   r[ins.dst] = std::log(r[ins.a]); break;
+                    case TapeOp::Exp:   r[ins.dst] = std::exp(r[ins.a]); break;
+                    case TapeOp::Sin:   r[ins.dst] = std::sin(r[ins.a]); break;
+                    case TapeOp::Cos:   r[ins.dst] = std::cos(r[ins.a]); break;
+                    case TapeOp::Tan:   r[ins.dst] = std::tan(r[ins.a]); break;
+                    case TapeOp::Cot:   r[ins.dst] = ::cot(r[ins.a]); break;
+                    case TapeOp::Sec:   r[ins.dst] = ::sec(r[ins.a]); break;
+                    case TapeOp::Csc:   r[ins.dst] = ::csc(r[ins.a]); break;
+                    case TapeOp::Sinh:  r[ins.dst] = std::sinh(r[ins.a]); break;
+                    case TapeOp::Cosh:  r[ins.dst] = std::cosh(r[ins.a]); break;
+                    case TapeOp::Tanh:  r[ins.dst] = std::tanh(r[ins.a]); break;
+                    case TapeOp::Coth:  r[ins.dst] = ::coth(r[ins.a]); break;
+                    case TapeOp::Sech:  r[ins.dst] = ::sech(r[ins.a]); break;
+                    case TapeOp::Csch:  r[ins.dst] = ::csch(r[ins.a]); break;
+
+                    case TapeOp::SinCos:   fusedSinCos(r[ins.a], r[ins.dst], r[ins.b]); break;
+                    case TapeOp::SinhCosh: fusedSinhCosh(r[ins.a], r[ins.dst], r[ins.b]); break;
+                }
+            }
+
+            return r[result];
+        }
+
+        double evaluate(const double *in) const
+        {
+            std::vector<double> r = workspace();
+            return evaluate(in, r.data());
+        }
+
+        /// Evaluate using the values of entries laid out like the schema
+        double evaluate(const std::vector<SubstituteEntry> &entries) const
+        {
+            std::vector<double> in;
+
+            for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+            {
+                in.push_back(it->value);
+            }
+
+            return evaluate(in.data());
+        }
+
+        /// @return Scratch space for `gradient`: a value and an adjoint per instruction
+        std::vector<double> gradientWorkspace() const
+        {
+            return std::vector<double>(2 * trace.size());
+        }
+
+        /**
+         * Evaluate the tape and, in one backward sweep, the derivative of the
+         * result with respect to every input slot, written to `grad`. Each
+         * slot is one substitution entry, such as `f` or `d^2f/dy^2`, so this
+         * is the gradient with respect to all bound quantities at a cost of
+         * a few evaluations. Slots the expression does not read get zero.
+         *
+         * @return The value of the expression
+         */
+        double gradient(const double *in, double *grad, double *w) const
+        {
+            const size_t n = trace.size();
+            double *v = w, *adj = w + n;
+
+            // whether value k is a sine whose cosine is value k + 1
+            auto paired = [&](size_t k) { return (k < n - 1) && isFusedPair(trace[k], trace[k + 1]); };
+
+            for (size_t i = 0; i < n; ++i)
+            {
+                const TapeInstruction &ins = trace[i];
+
+                switch (ins.op)
+                {
+                    case TapeOp::Load:  v[i] = in[ins.a]; break;
+                    case TapeOp::Const: v[i] = constants[ins.a]; break;
+                    case TapeOp::Add:   v[i] = v[ins.a] + v[ins.b]; break;
+                    case TapeOp::Sub:   v[i] = v[ins.a] - v[ins.b]; break;
+                    case TapeOp::Mul:   v[i] = v[ins.a] * v[ins.b]; break;
+                    case TapeOp::Div:   v[i] = v[ins.a] / v[ins.b]; break;
+                    case TapeOp::Neg:   v[i] = -v[ins.a]; break;
+                    case TapeOp::Pow:   v[i] = std::pow(v[ins.a], v[ins.b]); break;
+                    case TapeOp::Sqrt:  v[i] = std::sqrt(v[ins.a]); break;
+                    case TapeOp::Log:   v[i] = std::log(v[ins.a]); break;
+                    case TapeOp::Exp:   v[i] = std::exp(v[ins.a]); break;
+                    case TapeOp::Sin:
+                        if ((i + 1 < n) && isFusedPair(ins, trace[i + 1]))
+                        {
+                            fusedSinCos(v[ins.a], v[i], v[i + 1]);
+                            adj[i++] = 0;
+                        }
+                        else v[i] = std::sin(v[ins.a]);
+                        break;
+                    case TapeOp::Cos:   v[i] = std::cos(v[ins.a]); break;
+                    case TapeOp::Tan:   v[i] = std::tan(v[ins.a]); break;
+                    case TapeOp::Cot:   v[i] = ::cot(v[ins.a]); break;
+                    case TapeOp::Sec:   v[i] = ::sec(v[ins.a]); break;
+                    case TapeOp::Csc:   v[i] = ::csc(v[ins.a]); break;
+                    case TapeOp::Sinh:
+                        if ((i + 1 < n) && isFusedPair(ins, trace[i + 1]))
+                        {
+                            fusedSinhCosh(v[ins.a], v[i], v[i + 1]);
+                            adj[i++] = 0;
+                        }
+                        else v[i] = std::sinh(v[ins.a]);
+                        break;
+                    case TapeOp::Cosh:  v[i] = std::cosh(v[ins.a]); break;
+                    case TapeOp::Tanh:  v[i] = std::tanh(v[ins.a]); break;
+                    case TapeOp::Coth:  v[i] = ::coth(v[ins.a]); break;
+                    case TapeOp::Sech:  v[i] = ::sech(v[ins.a]); break;
+                    case TapeOp::Csch:  v[i] = ::csch(v[ins.a]); break;
+                    case TapeOp::SinCos:
+                    case TapeOp::SinhCosh: break;
+                }
+
+                adj[i] = 0;
+            }
+
+            for (size_t k = 0; k < inputs; ++k) grad[k] = 0;
+            adj[root] = 1;
+
+            for (size_t i = n; i-- > 0; )
+            {
+                const TapeInstruction &ins = trace[i];
+                const double g = adj[i];
+
+                if (g == 0) continue;
+
+                switch (ins.op)
+                {
+                    case TapeOp::Load:  grad[ins.a] += g; break;
+                    case TapeOp::Const: break;
+                    case TapeOp::Add:   adj[ins.a] += g; adj[ins.b] += g; break;
+                    case TapeOp::Sub:   adj[ins.a] += g; adj[ins.b] -= g; break;
+                    case TapeOp::Mul:   adj[ins.a] += g * v[ins.b]; adj[ins.b] += g * v[ins.a]; break;
+                    case TapeOp::Div:   adj[ins.a] += g / v[ins.b]; adj[ins.b] -= g * v[i] / v[ins.b]; break;
+                    case TapeOp::Neg:   adj[ins.a] -= g; break;
+                    case TapeOp::Pow:
+                        adj[ins.a] += g * v[ins.b] * std::pow(v[ins.a], v[ins.b] - 1);
+                        if (trace[ins.b].op != TapeOp::Const) adj[ins.b] += g * v[i] * std::log(v[ins.a]);
+                        break;
+                    case TapeOp::Sqrt:  adj[ins.a] += g * 0.5 / v[i]; break;
+                    case TapeOp::Log:   adj[ins.a] += g / v[ins.a]; break;
+                    case TapeOp::Exp:   adj[ins.a] += g * v[i]; break;
+                    case TapeOp::Sin:   adj[ins.a] += g * (paired(i) ? v[i + 1] : std::cos(v[ins.a])); break;
+                    case TapeOp::Cos:   adj[ins.a] -= g * (paired(i - 1) ? v[i - 1] : std::sin(v[ins.a])); break;
+                    case TapeOp::Tan:   adj[ins.a] += g * (1 + v[i] * v[i]); break;
+                    case TapeOp::Cot:   adj[ins.a] -= g * (1 + v[i] * v[i]); break;
+                    case TapeOp::Sec:   adj[ins.a] += g * v[i] * std::tan(v[ins.a]); break;
+                    case TapeOp::Csc:   adj[ins.a] -= g * v[i] * ::cot(v[ins.a]); break;
+                    case TapeOp::Sinh:  adj[ins.a] += g * (paired(i) ? v[i + 1] : std::cosh(v[ins.a])); break;
+                    case TapeOp::Cosh:  adj[ins.a] += g * (paired(i - 1) ? v[i - 1] : std::sinh(v[ins.a])); break;
+                    case TapeOp::Tanh:  adj[ins.a] += g * (1 - v[i] * v[i]); break;
+                    case TapeOp::Coth:  adj[ins.a] += g * (1 - v[i] * v[i]); break;
+                    case TapeOp::Sech:  adj[ins.a] -= g * v[i] * std::tanh(v[ins.a]); break;
+                    case TapeOp::Csch:  adj[ins.a] -= g * v[i] * ::coth(v[ins.a]); break;
+                    case TapeOp::SinCos:
+                    case TapeOp::SinhCosh: break;
+                }
+            }
+
+            return v[root];
+        }
+
+        double gradient(const double *in, double *grad) const
+        {
+            std::vector<double> w = gradientWorkspace();
+            return gradient(in, grad, w.data());
+        }
+
+        /// Gradient using the values of entries laid out like the schema
+        double gradient(const std::vector<SubstituteEntry> &entries, double *grad) const
+        {
+            std::vector<double> in;
+
+            for (auto it = entries.cbegin(); it != entries.cend(); ++it)
+            {
+                in.push_back(it->value);
+            }
+
+            return gradient(in.data(), grad);
+        }
+
+        friend std::ostream& operator<<(std::ostream &os, const Tape &tape)
+        {
+            for (const TapeInstruction &ins : tape.code)
+            {
+                os << "r" << ins.dst;
+                if ((ins.op == TapeOp::SinCos) || (ins.op == TapeOp::SinhCosh)) os << ", r" << ins.b;
+                os << " = " << tapeOpName(ins.op);
+
+                if (ins.op == TapeOp::Load) os << " in[" << ins.a << "]";
+                else if (ins.op == TapeOp::Const) os << " " << tape.constants[ins.a];
+                else if (tapeOpArity(ins.op) == 1) os << " r" << ins.a;
+                else os << " r" << ins.a << ", r" << ins.b;
+
+                os << std::endl;
+            }
+
+            os << "return r" << tape.result;
+            return os;
+        }
+
+        private:
+            friend struct TapeBuilder;
+
+            std::vector<TapeInstruction> code;
+            std::vector<double> constants;
+
+            /// The instructions before register allocation, with operands
+            /// numbered by instruction, as needed to sweep them backward
+            std::vector<TapeInstruction> trace;
+
+            size_t inputs = 0;
+            size_t registers = 0;
+            size_t nodes = 0;
+            uint32_t result = 0;
+            uint32_t root = 0;
+    };
+
+    struct TapeBuilder;
+
+    /// Value handle recorded while tracing an expression onto a tape
+    struct TapeValue
+    {
+        const TapeBuilder *builder;
+        uint32_t id;
+    };
+
+    /**
+     * Context for `evaluate` that records every operation instead of
+     * computing it. Values are numbered in static single assignment form
+     * and mapped onto a minimal register file by `finish`.
+     *
+     * Instructions are hash-consed: an operation on values that have
+     * already been combined the same way returns the earlier value, so each
+     * distinct subexpression of the traced tree is computed once.
+     */
+    struct TapeBuilder
+    {
+        TapeBuilder(const Schema &schema) :
+            schema(schema), loads(schema.size(), none) { }
+
+        TapeValue constant(double value) const
+        {
+            uint64_t bits;
+            std::memcpy(&bits, &value, sizeof(double));
+
+            auto it = constantIds.find(bits);
+
+            if (it != constantIds.end())
+            {
+                ++nodes;
+                return TapeValue{ this, it->second };
+            }
+
+            constants.push_back(value);
+
+            TapeValue v = emit(TapeOp::Const, constants.size() - 1, 0);
+            constantIds.emplace(bits, v.id);
+            return v;
+        }
+
+        template <typename L>
+        TapeValue lookup(const L &leaf) const
+        {
+            size_t slot = schema.find(leaf);
+
+            if (slot == Schema::npos) return constant(std::numeric_limits<double>::quiet_NaN());
+            return load(slot);
+        }
+
+        /// @return The value of a subexpression shared by several parents, traced once
+        template <typename F>
+        TapeValue shared(const void *key, F &&compute) const
+        {
+            auto it = sharedValues.find(key);
+
+            if (it != sharedValues.end())
+            {
+                ++nodes;
+                return TapeValue{ this, it->second };
+            }
+
+            TapeValue v = compute();
+            sharedValues.emplace(key, v.id);
+
+            return v;
+        }
+
+        /**
+         * Record `a^b`. A constant whole or half-whole exponent up to 32 in
+         * magnitude is reduced, as by Exponent, to products by repeated
+         * squaring, a square root for the half and one division for negative
+         * exponents, so no interpreter or generated kernel calls `pow` for it
+         * and the squares are shared with the rest of the tape.
+         */
+        TapeValue power(uint32_t a, uint32_t b) const
+        {
+            if (code[b].op != TapeOp::Const) return emit(TapeOp::Pow, a, b);
+
+            double p = constants[code[b].a], twice = 2 * p;
+            if ((twice != std::floor(twice)) || (std::fabs(p) > 32)) return emit(TapeOp::Pow, a, b);
+
+            // the whole chain counts as the one tree node it replaces
+            size_t before = nodes;
+            TapeValue square{ this, a }, product{ this, none };
+
+            if (p != std::floor(p)) product = emit(TapeOp::Sqrt, a, 0);
+
+            for (unsigned m = static_cast<unsigned>(std::floor(std::fabs(p))); m > 0; m >>= 1)
+            {
+                if (m & 1) product = (product.id == none) ? square : emit(TapeOp::Mul, product.id, square.id);
+                if (m > 1) square = emit(TapeOp::Mul, square.id, square.id);
+            }
+
+            if (product.id == none) product = constant(1);
+            else if (p < 0) product = emit(TapeOp::Div, constant(1).id, product.id);
+
+            nodes = before + 1;
+            return product;
+        }
+
+        /**
+         * Record a trigonometric or hyperbolic function of `a`. The sine and
+         * cosine of an argument are always recorded together, as adjacent
+         * instructions that `finish` fuses into one, and the other functions
+         * are quotients of the pair, so all functions of one argument cost a
+         * single evaluation and share their reciprocals, such as `1 / cos`.
+         * Only tanh keeps an instruction of its own, since sinh / cosh
+         * overflows long before tanh stops being one.
+         */
+        TapeValue circular(TapeOp op, uint32_t a) const
+        {
+            if (op == TapeOp::Tanh) return emit(TapeOp::Tanh, a, 0);
+
+            size_t before = nodes;
+            TapeValue r;
+
+            if (op == TapeOp::Coth) r = emit(TapeOp::Div, constant(1).id, emit(TapeOp::Tanh, a, 0).id);
+            else
+            {
+                bool hyperbolic = (op == TapeOp::Sinh) || (op == TapeOp::Cosh) ||
+                    (op == TapeOp::Sech) || (op == TapeOp::Csch);
+
+                uint32_t sn = emit(hyperbolic ? TapeOp::Sinh : TapeOp::Sin, a, 0).id;
+                uint32_t cs = emit(hyperbolic ? TapeOp::Cosh : TapeOp::Cos, a, 0).id;
+
+                switch (op)
+                {
+                    case TapeOp::Sin:
+                    case TapeOp::Sinh:  r = TapeValue{ this, sn }; break;
+                    case TapeOp::Cos:
+                    case TapeOp::Cosh:  r = TapeValue{ this, cs }; break;
+                    case TapeOp::Tan:   r = emit(TapeOp::Div, sn, cs); break;
+                    case TapeOp::Cot:   r = emit(TapeOp::Div, cs, sn); break;
+                    case TapeOp::Sec:
+                    case TapeOp::Sech:  r = emit(TapeOp::Div, constant(1).id, cs); break;
+                    default:            r = emit(TapeOp::Div, constant(1).id, sn); break;
+                }
+            }
+
+            nodes = before + 1;
+            return r;
+        }
+
+        TapeValue emit(TapeOp op, uint32_t a, uint32_t b) const
+        {
+            ++nodes;
+
+            // commutative operations share a single operand order
+            if (((op == TapeOp::Add) || (op == TapeOp::Mul)) && (b < a)) std::swap(a, b);
+
+            TapeInstruction ins = { op, static_cast<uint32_t>(code.size()), a, b };
+
+            if ((op != TapeOp::Load) && (op != TapeOp::Const))
+            {
+                auto it = memo.find(ins);
+
+                if (it != memo.end()) return TapeValue{ this, it->second };
+                memo.emplace(ins, ins.dst);
+            }
+
+            code.push_back(ins);
+            return TapeValue{ this, static_cast<uint32_t>(code.size() - 1) };
+        }
+
+        Tape finish(const TapeValue &root) const
+        {
+            Tape tape;
+            tape.constants = constants;
+            tape.inputs = schema.size();
+            tape.nodes = nodes;
+            tape.trace = code;
+            tape.root = root.id;
+
+            // values the result depends on; a sine or cosine recorded only
+            // as the partner of the other is not
+            std::vector<bool> live(code.size(), false);
+            live[root.id] = true;
+
+            for (size_t i = code.size(); i-- > 0; )
+            {
+                if (!live[i]) continue;
+
+                size_t arity = tapeOpArity(code[i].op);
+                if (arity > 0) live[code[i].a] = true;
+                if (arity > 1) live[code[i].b] = true;
+            }
+
+            // last instruction reading each value
+            std::vector<size_t> lastUse(code.size(), 0);
+
+            for (size_t i = 0; i < code.size(); ++i)
+            {
+                if (!live[i]) continue;
+
+                size_t arity = tapeOpArity(code[i].op);
+                if (arity > 0) lastUse[code[i].a] = i;
+                if (arity > 1) lastUse[code[i].b] = i;
+            }
+
+            lastUse[root.id] = code.size();
+
+            std::vector<uint32_t> reg(code.size());
+            std::vector<uint32_t> free;
+            size_t previous = none;
+
+            for (size_t i = 0; i < code.size(); ++i)
+            {
+                if (!live[i]) continue;
+
+                TapeInstruction ins = code[i];
+                size_t arity = tapeOpArity(ins.op);
+
+                if (arity > 0) ins.a = reg[code[i].a];
+                if (arity > 1) ins.b = reg[code[i].b];
+
+                // operands dying here can be overwritten by the result
+                if ((arity > 0) && (lastUse[code[i].a] == i)) free.push_back(ins.a);
+                if ((arity > 1) && (lastUse[code[i].b] == i) &&
+                    (code[i].b != code[i].a)) free.push_back(ins.b);
+
+                if (free.empty())
+                {
+                    reg[i] = static_cast<uint32_t>(tape.registers++);
+                }
+                else
+                {
+                    reg[i] = free.back();
+                    free.pop_back();
+                }
+
+                ins.dst = reg[i];
+
+                // a cosine right after the sine of the same argument joins
+                // its instruction; the argument is read before either is
+                // written, so the cosine may take over its register
+                if ((previous + 1 == i) && isFusedPair(code[previous], code[i]))
+                {
+                    TapeInstruction &fused = tape.code.back();
+                    fused.op = (fused.op == TapeOp::Sin) ? TapeOp::SinCos : TapeOp::SinhCosh;
+                    fused.b = ins.dst;
+                }
+                else tape.code.push_back(ins);
+
+                previous = i;
+            }
+
+            tape.result = reg[root.id];
+            return tape;
+        }
+
+        private:
+            static constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+
+            TapeValue load(size_t slot) const
+            {
+                if (loads[slot] == none) loads[slot] = emit(TapeOp::Load, slot, 0).id;
+                else ++nodes;
+
+                return TapeValue{ this, loads[slot] };
+            }
+
+            const Schema &schema;
+
+            mutable std::vector<uint32_t> loads;
+            mutable std::vector<TapeInstruction> code;
+            mutable std::vector<double> constants;
+
+            /// Value numbers of earlier operations, by opcode and operands
+            mutable std::unordered_map<TapeInstruction, uint32_t,
+                TapeOperationHash, TapeOperationEqual> memo;
+            mutable std::unordered_map<uint64_t, uint32_t> constantIds;
+            mutable std::unordered_map<const void*, uint32_t> sharedValues;
+            mutable size_t nodes = 0;
+    };
+
+    inline TapeValue operator+(const TapeValue &v1, const TapeValue &v2)
+    {
+        return v1.builder->emit(TapeOp::Add, v1.id, v2.id);
+    }
+
+    inline TapeValue operator-(const TapeValue &v1, const TapeValue &v2)
+    {
+        return v1.builder->emit(TapeOp::Sub, v1.id, v2.id);
+    }
+
+    inline TapeValue operator*(const TapeValue &v1, const TapeValue &v2)
+    {
+        return v1.builder->emit(TapeOp::Mul, v1.id, v2.id);
+    }
+
+    inline TapeValue operator/(const TapeValue &v1, const TapeValue &v2)
+    {
+        return v1.builder->emit(TapeOp::Div, v1.id, v2.id);
+    }
+
+    inline TapeValue operator-(const TapeValue &v)
+    {
+        return v.builder->emit(TapeOp::Neg, v.id, 0);
+    }
+
+    inline TapeValue pow(const TapeValue &v1, const TapeValue &v2)
+    {
+        return v1.builder->power(v1.id, v2.id);
+    }
+
+#define BZ_TAPE_UNARY(fn, op) \
+    inline TapeValue fn(const TapeValue &v) \
+    { \
+        return v.builder->emit(TapeOp::op, v.id, 0); \
+    }
+
+    BZ_TAPE_UNARY(log, Log)
+    BZ_TAPE_UNARY(exp, Exp)
+
+#undef BZ_TAPE_UNARY
+
+#define BZ_TAPE_CIRCULAR(fn, op) \
+    inline TapeValue fn(const TapeValue &v) \
+    { \
+        return v.builder->circular(TapeOp::op, v.id); \
+    }
+
+    BZ_TAPE_CIRCULAR(sin, Sin)
+    BZ_TAPE_CIRCULAR(cos, Cos)
+    BZ_TAPE_CIRCULAR(tan, Tan)
+    BZ_TAPE_CIRCULAR(cot, Cot)
+    BZ_TAPE_CIRCULAR(sec, Sec)
+    BZ_TAPE_CIRCULAR(csc, Csc)
+    BZ_TAPE_CIRCULAR(sinh, Sinh)
+    BZ_TAPE_CIRCULAR(cosh, Cosh)
+    BZ_TAPE_CIRCULAR(tanh, Tanh)
+    BZ_TAPE_CIRCULAR(coth, Coth)
+    BZ_TAPE_CIRCULAR(sech, Sech)
+    BZ_TAPE_CIRCULAR(csch, Csch)
+
+#undef BZ_TAPE_CIRCULAR
+
+    /**
+     * Lower an expression onto a tape. Each leaf reads its value from its
+     * slot in the schema; leaves without a slot evaluate to NaN. A vector of
+     * substitution entries may be passed as the schema, in which case only
+     * their names and derivatives are used.
+     */
+    template <typename E>
+    Tape compile(FunctionExpression<E> const& expr, const Schema &schema)
+    {
+        TapeBuilder builder(schema);
+        TapeValue root = static_cast<E const&>(expr).evaluate(builder);
+        return builder.finish(root);
+    }
+}
+
+#endif      // _BZTAPE_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -0,0 +1,310 @@
+#ifndef _BZTAYLOR_HH_
+#define _BZTAYLOR_HH_
+
+#include "bzexpression.hh"
+#include "bzhighorder.hh"
+
+#include <array>
+#include <cmath>
+#include <utility>
+
+namespace benzaiten
+{
+    /**
+     * A truncated Taylor series in one variable, `sum c[k] h^k` for k up to
+     * N. Arithmetic on series carries every derivative up to order N along
+     * with the value, so evaluating an expression with series in place of
+     * numbers differentiates it without building the derivative expression.
+     * Every operation costs O(N^2); `Taylor<1>` is an ordinary dual number.
+     */
+    template <size_t N>
+    struct Taylor
+    {
+        Taylor() : c{ } { }
+
+        explicit Taylor(double value) : c{ } { c[0] = value; }
+
+        double getValue() const { return c[0]; }
+
+        /// @return The derivative of order `k` at the expansion point
+        double getDerivative(size_t k) const
+        {
+            double scale = 1;
+            for (size_t j = 2; j <= k; ++j) scale *= j;
+
+            return c[k] * scale;
+        }
+
+        /// @return Whether the series has no terms beyond the value
+        bool isConstant() const
+        {
+            for (size_t k = 1; k <= N; ++k) if (c[k] != 0) return false;
+            return true;
+        }
+
+        std::array<double, N + 1> c;
+    };
+
+    /// A dual number, carrying a value and its first derivative
+    using Dual = Taylor<1>;
+
+    template <size_t N>
+    Taylor<N> operator+(const Taylor<N> &a, const Taylor<N> &b)
+    {
+        Taylor<N> r;
+        for (size_t k = 0; k <= N; ++k) r.c[k] = a.c[k] + b.c[k];
+        return r;
+    }
+
+    template <size_t N>
+    Taylor<N> operator-(const Taylor<N> &a, const Taylor<N> &b)
+    {
+        Taylor<N> r;
+        for (size_t k = 0; k <= N; ++k) r.c[k] = a.c[k] - b.c[k];
+        return r;
+    }
+
+    template <size_t N>
+    Taylor<N> operator-(const Taylor<N> &a)
+    {
+        Taylor<N> r;
+        for (size_t k = 0; k <= N; ++k) r.c[k] = -a.c[k];
+        return r;
+    }
+
+    template <size_t N>
+    Taylor<N> operator*(const Taylor<N> &a, const Taylor<N> &b)
+    {
+        Taylor<N> r;
+
+        for (size_t k = 0; k <= N; ++k)
+        {
+            for (size_t j = 0; j <= k; ++j) r.c[k] += a.c[j] * b.c[k - j];
+        }
+
+        return r;
+    }
+
+    template <size_t N>
+    Taylor<N> operator/(const Taylor<N> &a, const Taylor<N> &b)
+    {
+        Taylor<N> r;
+
+        for (size_t k = 0; k <= N; ++k)
+        {
+            double s = a.c[k];
+            for (size_t j = 0; j < k; ++j) s -= r.c[j] * b.c[k - j];
+            r.c[k] = s / b.c[0];
+        }
+
+        return r;
+    }
+
+    template <size_t N>
+    Taylor<N> exp(const Taylor<N> &a)
+    {
+        Taylor<N> r;
+        r.c[0] = std::exp(a.c[0]);
+
+        for (size_t k = 1; k <= N; ++k)
+        {
+            for (size_t j = 1; j <= k; ++j) r.c[k] += j * a.c[j] * r.c[k - j];
+            r.c[k] /= k;
+        }
+
+        return r;
+    }
+
+    template <size_t N>
+    Taylor<N> log(const Taylor<N> &a)
+    {
+        Taylor<N> r;
+        r.c[0] = std::log(a.c[0]);
+
+        for (size_t k = 1; k <= N; ++k)
+        {
+            double s = 0;
+            for (size_t j = 1; j < k; ++j) s += j * r.c[j] * a.c[k - j];
+            r.c[k] = (a.c[k] - s / k) / a.c[0];
+        }
+
+        return r;
+    }
+
+    /**
+     * A power of a series. A constant exponent uses the recurrence for
+     * `a^r`, which also covers negative bases; otherwise `exp(b log a)`.
+     */
+    template <size_t N>
+    Taylor<N> pow(const Taylor<N> &a, const Taylor<N> &b)
+    {
+        if (!b.isConstant()) return exp(b * log(a));
+
+        const double e = b.c[0];
+
+        if (a.c[0] == 0)
+        {
+            // the recurrence divides by the value; whole powers still work
+            if ((e < 0) || (e != std::floor(e))) return exp(b * log(a));
+
+            Taylor<N> r(1);
+            for (size_t k = 0; k < e; ++k) r = r * a;
+            return r;
+        }
+
+        Taylor<N> r;
+        r.c[0] = std::pow(a.c[0], e);
+
+        for (size_t k = 1; k <= N; ++k)
+        {
+            for (size_t j = 1; j <= k; ++j) r.c[k] += (e * j - (k - j)) * a.c[j] * r.c[k - j];
+            r.c[k] /= k * a.c[0];
+        }
+
+        return r;
+    }
+
+    /**
+     * Series of a sine and cosine pair, whose recurrences need each other;
+     * the values at the expansion point must already be in `s` and `co`.
+     * The sign is -1 for the circular functions and +1 for the hyperbolic.
+     */
+    template <size_t N>
+    void sinCosSeries(const Taylor<N> &a, Taylor<N> &s, Taylor<N> &co, double sign)
+    {
+        for (size_t k = 1; k <= N; ++k)
+        {
+            double ss = 0, cc = 0;
+
+            for (size_t j = 1; j <= k; ++j)
+            {
+                ss += j * a.c[j] * co.c[k - j];
+                cc += j * a.c[j] * s.c[k - j];
+            }
+
+            s.c[k] = ss / k;
+            co.c[k] = sign * cc / k;
+        }
+    }
+
+    template <size_t N>
+    void sinCos(const Taylor<N> &a, Taylor<N> &s, Taylor<N> &co)
+    {
+        s.c[0] = std::sin(a.c[0]);
+        co.c[0] = std::cos(a.c[0]);
+        sinCosSeries(a, s, co, -1);
+    }
+
+    template <size_t N>
+    void sinhCosh(const Taylor<N> &a, Taylor<N> &s, Taylor<N> &co)
+    {
+        s.c[0] = std::sinh(a.c[0]);
+        co.c[0] = std::cosh(a.c[0]);
+        sinCosSeries(a, s, co, 1);
+    }
+
+    template <size_t N>
+    Taylor<N> sin(const Taylor<N> &a) { Taylor<N> s, co; sinCos(a, s, co); return s; }
+
+    template <size_t N>
+    Taylor<N> cos(const Taylor<N> &a) { Taylor<N> s, co; sinCos(a, s, co); return co; }
+
+    template <size_t N>
+    Taylor<N> tan(const Taylor<N> &a) { Taylor<N> s, co; sinCos(a, s, co); return s / co; }
+
+    template <size_t N>
+    Taylor<N> cot(const Taylor<N> &a) { Taylor<N> s, co; sinCos(a, s, co); return co / s; }
+
+    template <size_t N>
+    Taylor<N> sec(const Taylor<N> &a) { return Taylor<N>(1) / cos(a); }
+
+    template <size_t N>
+    Taylor<N> csc(const Taylor<N> &a) { return Taylor<N>(1) / sin(a); }
+
+    template <size_t N>
+    Taylor<N> sinh(const Taylor<N> &a) { Taylor<N> s, co; sinhCosh(a, s, co); return s; }
+
+    template <size_t N>
+    Taylor<N> cosh(const Taylor<N> &a) { Taylor<N> s, co; sinhCosh(a, s, co); return co; }
+
+    template <size_t N>
+    Taylor<N> tanh(const Taylor<N> &a) { Taylor<N> s, co; sinhCosh(a, s, co); return s / co; }
+
+    template <size_t N>
+    Taylor<N> coth(const Taylor<N> &a) { Taylor<N> s, co; sinhCosh(a, s, co); return co / s; }
+
+    template <size_t N>
+    Taylor<N> sech(const Taylor<N> &a) { return Taylor<N>(1) / cosh(a); }
+
+    template <size_t N>
+    Taylor<N> csch(const Taylor<N> &a) { return Taylor<N>(1) / sinh(a); }
+
+    /**
+     * Context evaluating an expression as a Taylor series in `var` about
+     * the point described by another context. Every leaf is expanded from
+     * the values the base context holds for its derivatives by `var`, so a
+     * function `f(x)` needs entries for f, f_x, ..., up to order N; a
+     * variable needs only its value.
+     */
+    template <size_t N, typename V, typename C>
+    struct TaylorContext
+    {
+        TaylorContext(const V &var, const C &base) : var(var), base(base) { }
+
+        Taylor<N> constant(double value) const { return Taylor<N>(value); }
+
+        template <typename L>
+        Taylor<N> lookup(const L &leaf) const
+        {
+            return lookup(leaf, std::make_index_sequence<N + 1>());
+        }
+
+        private:
+            template <typename L, size_t... Ks>
+            Taylor<N> lookup(const L &leaf, std::index_sequence<Ks...>) const
+            {
+                Taylor<N> r;
+                ((r.c[Ks] = leaf.template derivative<Ks>(var).evaluate(base) / factorial(Ks)), ...);
+                return r;
+            }
+
+            const V &var;
+            const C &base;
+    };
+
+    /// How `derivativeAt` differentiates an expression
+    enum class Differentiation
+    {
+        Symbolic,       ///< Build `derivative<Order>` and evaluate it
+        Taylor          ///< Evaluate the expression once on Taylor series
+    };
+
+    /**
+     * @return The derivative of order `Order` by `var` of an expression,
+     * evaluated in the context `ctx`. Symbolic differentiation builds a new
+     * expression type whose size grows quickly with the order, but it can be
+     * reused, bound and compiled; Taylor series cost O(Order^2) per node and
+     * never build anything. The method is a template argument so that only
+     * the chosen one is instantiated.
+     */
+    template <size_t Order, Differentiation Method = Differentiation::Taylor,
+        typename E, typename V, typename C>
+    double derivativeAt(FunctionExpression<E> const& expr, const V &var, const C &ctx)
+    {
+        const E &e = static_cast<const E&>(expr);
+
+        if constexpr (Method == Differentiation::Symbolic)
+        {
+            return e.template derivative<Order>(var).evaluate(ctx);
+        }
+        else
+        {
+            TaylorContext<Order, V, C> series(var, ctx);
+            return e.evaluate(series).getDerivative(Order);
+        }
+    }
+}
+
+#endif      // _BZTAYLOR_HH_
+
+// vim: set ft=cpp.doxygen:
@@ -1,7 +1,15 @@
 #include "benzaiten.hh"
 
+#include <cstdlib>
+#include <filesystem>
+
 using namespace benzaiten;
 
+struct x_tag { static constexpr const char *name = "x"; };
+struct t_tag { static constexpr const char *name = "t"; };
+struct u_tag { static constexpr const char *name = "u"; };
+struct v_tag { static constexpr const char *name = "v"; };
+
 int main(int argc, char **argv)
 {
     Variable t("t", Temporal), x("x", Spatial), y("y", Spatial);
@@ -57,7 +65,16 @@ int main(int argc, char **argv)
 
     std::cout << "<<< testing square root >>>" << std::endl;
     auto rt = sqrt(f);
-    std::cout << rt.derivative<2>(x) << std::endl << std::endl;
+    std::cout << rt.derivative<2>(x) << std::endl;
+
+    // the root of a constant folds, as its power of one half does
+    static_assert(std::is_same<decltype(sqrt(Constant(4))), Constant>::value, "sqrt of a constant folds");
+    std::cout << sqrt(Constant(4)) << " " << pow(Constant(4), 0.5) << std::endl << std::endl;
+
+    std::cout << "<<< testing integer power >>>" << std::endl;
+    auto cube = pow<3>(f);
+    std::cout << cube.derivative<2>(x) << std::endl;
+    std::cout << pow<-2>(f).derivative(x) << std::endl << std::endl;
 
     // testing log and exp
     std::cout << "<<< testing log and exp >>>" << std::endl;
@@ -151,6 +168,258 @@ int main(int argc, char **argv)
     auto test6 = (1. / x) * (x * f).derivative(x);
     std::cout << test6 << " = " << test6.substitute(subs) << std::endl << std::endl;
 
+    // testing evaluate; the expressions are not modified, so they can be reused
+    std::cout << "<<< testing evaluation >>>" << std::endl;
+    Context ctx(subs);
+
+    std::cout << test1.evaluate(ctx) << std::endl;
+    std::cout << test2.evaluate(ctx) << std::endl;
+    std::cout << test3.evaluate(ctx) << std::endl;
+    std::cout << test4.evaluate(ctx) << std::endl;
+    std::cout << test5.evaluate(ctx) << std::endl;
+    std::cout << test6.evaluate(ctx) << std::endl;
+    std::cout << tanh_.derivative(x).evaluate(ctx) << std::endl;
+    std::cout << pwr.derivative(x).evaluate(ctx) << std::endl;
+    std::cout << cube.derivative(x).evaluate(ctx) << std::endl << std::endl;
+
+    // testing compiled tapes
+    std::cout << "<<< testing compiled tape >>>" << std::endl;
+    Tape tape = compile(test1, subs);
+    std::cout << tape << std::endl;
+    std::cout << tape.evaluate(subs) << std::endl;
+
+    // testing the gradient with respect to every entry
+    std::vector<double> grad(subs.size());
+    tape.gradient(subs, grad.data());
+    for (size_t i = 0; i < subs.size(); ++i) std::cout << grad[i] << " ";
+    std::cout << std::endl;
+
+    // testing common subexpressions
+    Tape tanTape = compile(tan(f).derivative<2>(x), subs);
+    std::cout << tanTape.treeSize() << " tree nodes, " << tanTape.size() << " instructions" << std::endl;
+
+    // half-whole powers become square roots and products
+    Tape rootTape = compile(test4, subs);
+    size_t roots = 0, pows = 0;
+
+    for (const TapeInstruction &ins : rootTape.instructions())
+    {
+        if (ins.op == TapeOp::Sqrt) ++roots;
+        if (ins.op == TapeOp::Pow) ++pows;
+    }
+
+    std::cout << rootTape.evaluate(subs) << " (" << roots << " sqrt, " << pows << " pow)" << std::endl << std::endl;
+
+    // testing runtime expressions; the derivative is built at run time
+    // and shares its repeated subexpressions
+    std::cout << "<<< testing runtime expressions >>>" << std::endl;
+    DagArena arena;
+    DagExpression dag = toDag(arena, f * csc(g));
+    std::cout << dag.derivative(x) << " = " << dag.derivative(x).substitute(subs) << std::endl;
+    std::cout << dag.derivative(x).evaluate(ctx) << " " << compile(dag.derivative(x), subs).evaluate(subs) << std::endl;
+    std::cout << dag.derivative<3>(x).numNodes() << " nodes of " << arena.size() << std::endl << std::endl;
+
+    // testing parsed expressions; the same expression, read from text
+    std::cout << "<<< testing parsed expressions >>>" << std::endl;
+    ExpressionParser parser(arena);
+    auto parsed = parser.parse("Variable t : Temporal, x : Spatial;\n"
+        "Function f(t, x, y), g(x, t);\n"
+        "f * csc(g(x, t))   # the test expression");
+    std::cout << parsed->derivative("x") << " = " << parsed->derivative("x").evaluate(ctx) << std::endl;
+    std::cout << ((parsed->getNode() == dag.getNode()) ? "same" : "different") << " node" << std::endl;
+    if (!parser.parse("f * sin(h)")) std::cout << parser.error() << " at " << parser.errorPosition() << std::endl;
+    std::cout << std::endl;
+
+    // testing shared subexpressions; every use of fg refers to one copy
+    std::cout << "<<< testing shared subexpressions >>>" << std::endl;
+    auto fg = ref(f * g);
+    auto shared = (sin(fg) + fg * exp(fg)).derivative(x);
+    std::cout << shared << " = " << shared.evaluate(ctx) << std::endl;
+    std::cout << compile(shared, subs).treeSize() << " tree nodes" << std::endl;
+    auto wave = ref(sin(x) * (t ^ 2));
+    std::cout << wave.derivative<3>(x).evaluate(ctx) << " " << (sin(x) * (t ^ 2)).derivative<3>(x).evaluate(ctx) << std::endl << std::endl;
+
+    // testing erased expressions; derivatives of an erased expression keep its type
+    std::cout << "<<< testing erased expressions >>>" << std::endl;
+    ErasedExpression erased = erase((x * (x * (t ^ 2)).derivative(x)));
+    std::cout << erased.derivative(x) << " = " << erased.derivative(x).evaluate(ctx) << std::endl;
+    std::cout << erase(f * csc(g)).derivative(x).evaluate(ctx) << " " << (f * csc(g)).derivative(x).evaluate(ctx) << std::endl << std::endl;
+
+    // testing code generation
+    std::cout << "<<< testing code generation >>>" << std::endl;
+    std::cout << generateC(test3, subs, "test3") << std::endl;
+
+    // testing bound plans
+    std::cout << "<<< testing bound plans >>>" << std::endl;
+    Schema schema;
+    size_t fs = schema.add("f"), dfs = schema.add("f", { { "x", 1 } });
+    size_t gs = schema.add("g"), dgs = schema.add("g", { { "x", 1 } });
+    size_t xs = schema.add(x), ts = schema.add(t);
+
+    std::vector<double> values(schema.size());
+    values[fs] = 1; values[dfs] = 3; values[gs] = 2; values[dgs] = 4; values[xs] = 5; values[ts] = 6;
+
+    auto plan1 = bind(test1, schema);
+    std::cout << plan1(values) << std::endl;
+
+    auto plan3 = bind(test3, schema);
+    std::cout << plan3(values) << std::endl;
+
+    auto plan5 = bind(test5, schema);
+    std::cout << plan5(values) << " (complete: " << plan5.complete() << ")" << std::endl;
+
+    // finding what is unbound before evaluating
+    auto lg2 = lg.derivative<2>(x);
+    for (const std::string &key : missingInputs(lg2, schema)) std::cout << key << " ";
+    std::cout << "(missing of " << requiredInputs(lg2).size() << " inputs)" << std::endl << std::endl;
+
+    // testing grid evaluation
+    std::cout << "<<< testing grid evaluation >>>" << std::endl;
+    const size_t npts = 4;
+    double fv[npts] = { 1, 2, 3, 4 }, dfv[npts] = { 3, 3, 3, 3 };
+    double xv[npts] = { 5, 6, 7, 8 }, tv = 6, out[npts];
+
+    FieldLayout layout;
+    layout.set("f", fv).set("f", { { "x", 1 } }, dfv).set(x, xv).set(t, &tv, 0);
+
+    evaluate(test3, layout, out, npts);
+    for (size_t i = 0; i < npts; ++i) std::cout << out[i] << " ";
+    std::cout << std::endl;
+
+    evaluate(test6, layout, out, npts);
+    for (size_t i = 0; i < npts; ++i) std::cout << out[i] << " ";
+    std::cout << std::endl;
+
+    ThreadPool pool(2);
+    evaluate(test3, layout, out, npts, pool, 1);
+    for (size_t i = 0; i < npts; ++i) std::cout << out[i] << " ";
+    std::cout << std::endl;
+
+    // derivatives of f from finite differences on the grid instead
+    Grid grid;
+    grid.axis("x", npts, 1);
+
+    FieldLayout gridLayout;
+    gridLayout.set("f", fv).set(x, xv);
+
+    evaluate(test3, grid, gridLayout, out);
+    for (size_t i = 0; i < npts; ++i) std::cout << out[i] << " ";
+    std::cout << std::endl;
+
+    // an axis shorter than the stencil gives NaN rather than reading past it
+    Grid shortGrid;
+    shortGrid.axis("x", 2, 1);
+
+    evaluate(test3, shortGrid, gridLayout, out);
+    std::cout << out[0] << " " << out[1] << std::endl;
+
+    // kernels go to a directory of the test's own rather than the user's cache
+    JitOptions jitOptions;
+    jitOptions.cacheDirectory.clear();
+
+#ifdef BZ_HAVE_DLOPEN
+    char cacheTemplate[] = "/tmp/benzaiten-test.XXXXXX";
+    if (mkdtemp(cacheTemplate) != nullptr) jitOptions.cacheDirectory = cacheTemplate;
+#endif
+
+    // native or not, the kernel gives the same values
+    auto kernel = jit(test3, layout.getSchema(), jitOptions);
+    kernel.evaluate(layout, out, npts);
+    for (size_t i = 0; i < npts; ++i) std::cout << out[i] << " ";
+    std::cout << std::endl;
+
+    // a negation of a negation is still valid C
+    auto negated = jit(x - (-ref(-f)), layout.getSchema(), jitOptions);
+    negated.evaluate(layout, out, npts);
+    for (size_t i = 0; i < npts; ++i) std::cout << out[i] << " ";
+    std::cout << "(native: " << negated.isNative() << ")" << std::endl;
+
+    // without a compiler the plan evaluator stands in, so this is reported rather than fatal
+    if (!negated.isNative()) std::cout << "no native kernel: " << negated.error() << std::endl;
+    std::cout << std::endl;
+
+    if (!jitOptions.cacheDirectory.empty()) std::filesystem::remove_all(jitOptions.cacheDirectory);
+
+    // testing sparse jacobians
+    std::cout << "<<< testing sparse jacobian >>>" << std::endl;
+    SparseJacobian jac(Schema(), npts);
+    jac.unknown("f").stencil("f", { { "x", 1 } }, Stencil({ -1, 1 }, { -0.5, 0.5 }));
+    jac.equation(test3);
+
+    FieldLayout jacLayout(jac.getSchema());
+    jacLayout.set("f", fv).set("f", { { "x", 1 } }, dfv).set(x, xv);
+
+    const SparseMatrix &jm = jac.assemble(jacLayout, out);
+    for (size_t r = 0; r < jm.rows; ++r)
+    {
+        for (size_t p = jm.rowStart[r]; p < jm.rowStart[r + 1]; ++p)
+        {
+            std::cout << "(" << r << ", " << jm.column[p] << ") = " << jm.values[p] << "  ";
+        }
+
+        std::cout << "residual " << out[r] << std::endl;
+    }
+
+    // on a 3 x 2 grid, the x stencil stops at the end of each row
+    Grid plane;
+    plane.axis("x", 3, 1).axis("y", 2, 1);
+
+    SparseJacobian planeJac(Schema(), plane);
+    planeJac.unknown("f").stencil("f", { { "x", 1 } }, Stencil({ -1, 1 }, { -0.5, 0.5 }));
+    planeJac.equation(f.derivative(x));
+
+    const SparseMatrix &pm = planeJac.pattern();
+    for (size_t r = 0; r < pm.rows; ++r)
+    {
+        std::cout << r << ":";
+        for (size_t p = pm.rowStart[r]; p < pm.rowStart[r + 1]; ++p) std::cout << " " << pm.column[p];
+        std::cout << "  ";
+    }
+
+    std::cout << std::endl << std::endl;
+
+    // testing compile-time variables
+    std::cout << "<<< testing static variables >>>" << std::endl;
+    using X = StaticVariable<x_tag>;
+    using T = StaticVariable<t_tag>;
+    X sx;
+    T st;
+    StaticFunction<u_tag, T, X> u;
+    StaticFunction<v_tag, T> v;
+
+    auto test7 = u * v;
+    std::cout << test7.derivative<2>(sx) << std::endl;
+    std::cout << v.derivative<3>(sx) << std::endl;
+
+    Schema uvSchema;
+    uvSchema.add("u");
+    uvSchema.add("u", { { "x", 1 } });
+    uvSchema.add("v");
+
+    auto plan7 = bind(test7.derivative(sx), uvSchema);
+    std::cout << plan7({ 2, 3, 5 }) << " (complete: " << plan7.complete() << ")" << std::endl;
+
+    // the inputs of a static expression are part of its type
+    using Test7x = decltype(test7.derivative(sx));
+    static_assert(isBoundBy<Test7x, decltype(u), decltype(u.derivative(sx)), decltype(v)>(),
+        "u, u_x and v cover everything d(uv)/dx reads");
+
+    for (const std::string &key : staticKeys(LeavesOf<Test7x>())) std::cout << key << " ";
+    std::cout << std::endl << std::endl;
+
+    // testing Taylor-mode differentiation
+    std::cout << "<<< testing taylor series >>>" << std::endl;
+    Context point;
+    point.set("x", 0.5).set("y", 2).set("g", 3).set("g", 0.5, { { "x", 1 } })
+        .set("g", -1, { { "x", 2 } }).set("g", 0.25, { { "x", 3 } });
+
+    auto test8 = sin(x * y) / g;
+    std::cout << derivativeAt<3, Differentiation::Symbolic>(test8, x, point) << " "
+        << derivativeAt<3>(test8, x, point) << std::endl;
+
+    // an erased expression expands its leaves from the same point
+    std::cout << derivativeAt<3>(erase(test8), x, point) << std::endl << std::endl;
+
     return 0;
 }
 
@@ -4,6 +4,7 @@
 #include "bzvariable.hh"
 #include "bzfunction.hh"
 #include "bzneg.hh"
+#include "bzhighorder.hh"
 
 #include <cmath>
 
@@ -42,100 +43,27 @@ namespace benzaiten
     template <typename E>
     struct FunctionCosecant;
 
-    template <typename F, size_t Order>
-    struct SineDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionCosine<F>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct SineDerivativeType<F, 0>
-    {
-        using type = FunctionSine<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct CosineDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionNegate<FunctionSine<F>>,
-            typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct CosineDerivativeType<F, 0>
-    {
-        using type = FunctionCosine<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct TangentDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionProduct<FunctionSecant<F>,
-            FunctionSecant<F>>, typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct TangentDerivativeType<F, 0>
-    {
-        using type = FunctionTangent<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct CotangentDerivativeType
-    {
-        using type =
-            typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionCosecant<F>>,
-                FunctionCosecant<F>>, typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct CotangentDerivativeType<F, 0>
-    {
-        using type = FunctionCotangent<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct SecantDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionProduct<FunctionSecant<F>,
-            FunctionTangent<F>>, typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct SecantDerivativeType<F, 0>
-    {
-        using type = FunctionSecant<F>;
-    };
-
-    template <typename F, size_t Order>
-    struct CosecantDerivativeType
-    {
-        using type = typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionCosecant<F>>,
-            FunctionCotangent<F>>, typename F::template deriv_type<1>, Order - 1>::type;
-    };
-
-    template <typename F>
-    struct CosecantDerivativeType<F, 0>
-    {
-        using type = FunctionCosecant<F>;
-    };
-
     template <typename E>
     struct FunctionSine : public FunctionExpression<FunctionSine<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionCosine<E>,
-                typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionSine(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename SineDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return (cos(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
+                else return faaDiBruno<Order>(*this, fn, var);
+            }
+
+            /// @return `d^K sin(u) / du^K` at `u = fn`, cycling with period 4
+            template <size_t K>
+            auto outerDerivative() const
+            {
+                if constexpr (K % 4 == 0) return *this;
+                else if constexpr (K % 4 == 1) return cos(fn);
+                else if constexpr (K % 4 == 2) return -(*this);
+                else return -cos(fn);
             }
 
             FunctionSine<E>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -156,6 +84,17 @@ namespace benzaiten
                 return FunctionSine<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::sin;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return sin(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -185,17 +124,23 @@ namespace benzaiten
     struct FunctionCosine : public FunctionExpression<FunctionCosine<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionNegate<FunctionSine<E>>,
-                typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionCosine(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename CosineDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
-                else return (-sin(fn) * fn.template derivative<1>(var)).template derivative<Order-1>(var);
+                else return faaDiBruno<Order>(*this, fn, var);
+            }
+
+            /// @return `d^K cos(u) / du^K` at `u = fn`, cycling with period 4
+            template <size_t K>
+            auto outerDerivative() const
+            {
+                if constexpr (K % 4 == 0) return *this;
+                else if constexpr (K % 4 == 1) return -sin(fn);
+                else if constexpr (K % 4 == 2) return -(*this);
+                else return sin(fn);
             }
 
             FunctionCosine<E>& substituteInPlace(const std::vector<SubstituteEntry> &subs)
@@ -216,6 +161,17 @@ namespace benzaiten
                 return FunctionCosine<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::cos;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return cos(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -245,14 +201,10 @@ namespace benzaiten
     struct FunctionTangent : public FunctionExpression<FunctionTangent<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionProduct<FunctionSecant<E>,
-                FunctionSecant<E>>, typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionTangent(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename TangentDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return (sec(fn) * sec(fn) *
@@ -277,6 +229,17 @@ namespace benzaiten
                 return FunctionTangent<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using std::tan;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return tan(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -306,14 +269,10 @@ namespace benzaiten
     struct FunctionCotangent : public FunctionExpression<FunctionCotangent<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionCosecant<E>>,
-                FunctionCosecant<E>>, typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionCotangent(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename CotangentDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return (-csc(fn) * csc(fn) *
@@ -338,6 +297,17 @@ namespace benzaiten
                 return FunctionCotangent<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using ::cot;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return cot(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -367,14 +337,10 @@ namespace benzaiten
     struct FunctionSecant : public FunctionExpression<FunctionSecant<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionProduct<FunctionSecant<E>,
-                FunctionTangent<E>>, typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionSecant(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename SecantDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return (sec(fn) * tan(fn) *
@@ -399,6 +365,17 @@ namespace benzaiten
                 return FunctionSecant<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using ::sec;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return sec(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
@@ -428,14 +405,10 @@ namespace benzaiten
     struct FunctionCosecant : public FunctionExpression<FunctionCosecant<E>>
     {
         public:
-            template <size_t Order = 1>
-            using deriv_type = typename ProductDerivativeType<FunctionProduct<FunctionNegate<FunctionCosecant<E>>,
-                FunctionCotangent<E>>, typename E::template deriv_type<1>, Order - 1>::type;
-
             FunctionCosecant(const E &fn) : fn(fn) { }
 
-            template <size_t Order = 1>
-            typename CosecantDerivativeType<E, Order>::type derivative(const Variable &var) const
+            template <size_t Order = 1, typename V = Variable>
+            auto derivative(const V &var) const
             {
                 if constexpr (Order == 0) return *this;
                 else return (-csc(fn) * cot(fn) *
@@ -460,6 +433,17 @@ namespace benzaiten
                 return FunctionCosecant<E>(*this).substituteInPlace(subs);
             }
 
+            template <typename C>
+            auto evaluate(const C &ctx) const
+            {
+                using ::csc;
+
+                if (_isConcrete) return ctx.constant(_value);
+
+                auto v = fn.evaluate(ctx);
+                return csc(v);
+            }
+
             bool isConcrete() const { return _isConcrete; }
 
             double getValue() const { return _value; }
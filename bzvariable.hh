@@ -17,20 +17,24 @@ namespace benzaiten
 
     struct Variable : public FunctionExpression<Variable>
     {
-        template <size_t Order>
-        using deriv_type = Variable;
-
         Variable(const std::string &name, VariableType type) :
-            name(name), type(type) { }
+            name(internName(name)), type(type) { }
 
-        Variable(const Variable &other) : name(other.name),
-            type(other.type), _isConcrete(other._isConcrete),
-                _value(other._value) { }
+        const std::string& getName() const { return *name; }
 
-        std::string getName() const { return name; }
+        /// @return The shared copy of the name; equal names give equal pointers
+        const std::string* internedName() const { return name; }
 
         VariableType getType() const { return type; }
 
+        /// @return Identity of this variable, see leafKey
+        std::string key() const { return *name; }
+
+        bool operator==(const SubstituteEntry &entry) const
+        {
+            return entry.name == *name;
+        }
+
         template <size_t Order = 1>
         Variable& derivativeInPlace(const Variable &other)
         {
@@ -59,7 +63,8 @@ namespace benzaiten
         template <size_t Order = 1>
         Variable derivative(const Variable &other) const
         {
-            return Variable(*this).derivativeInPlace<Order>(other);
+            if constexpr (Order == 0) return *this;
+            else return Variable(*this).derivativeInPlace<Order>(other);
         }
 
         bool isConcrete() const { return _isConcrete; }
@@ -70,7 +75,7 @@ namespace benzaiten
         {
             for (auto it = entries.cbegin(); it != entries.cend(); ++it)
             {
-                if ((it->name == name) && (!_isConcrete))
+                if ((it->name == *name) && (!_isConcrete))
                 {
                     _isConcrete = true;
                     _value = it->value;
@@ -86,20 +91,28 @@ namespace benzaiten
             return Variable(*this).substituteInPlace(entries);
         }
 
+        template <typename C>
+        auto evaluate(const C &ctx) const
+        {
+            if (_isConcrete) return ctx.constant(_value);
+            return ctx.lookup(*this);
+        }
+
         friend std::ostream& operator<<(std::ostream &os, const Variable &vbl)
         {
             if (vbl._isConcrete) os << vbl._value;
-            else os << vbl.name;
+            else os << *vbl.name;
 
             return os;
         }
 
         private:
-            std::string name;
+            /// Unique name of this variable
+            const std::string *name;
             VariableType type;
 
             bool _isConcrete = false;
-            double _value;
+            double _value = 0;
     };
 }
 